@@ -49,7 +49,7 @@ static inline void h2_write4(uint32_t val, char * pos, int align) {
     if (align) {
         *(uint32_t *)pos = endian_int32(val);
     } else {
-        uint32_t tint = val;
+        uint32_t tint = endian_int32(val);
         memcpy(pos, &tint, 4);
     }
     pos += 4;
@@ -148,19 +148,84 @@ int h2_str2huf(const char * str, int slen, char * buf, int buflen) {
 
 
 /*
- * Convert a huffman encoding to a string
+ * The result of decoding a symbol when only the padding is left
+ */
+#define H2HUF_PAD 256
+
+
+/*
+ * Decode one symbol from the low bits of the accumulator.
+ * A symbol is a run of one bits followed by a value which is looked up for that run.
+ * @return The symbol, H2HUF_PAD if the bits are padding, or a negative error
+ */
+static inline int h2_hufSymbol(uint64_t a, int * pbits) {
+    onetab_t * tab;
+    uint64_t mask;
+    int bits = *pbits;
+    int onebits;
+    int val;
+
+    mask = 1;
+    mask <<= (bits-1);
+    onebits = 0;
+    while (a&mask) {
+        onebits++;
+        mask = mask >> 1;
+    }
+    if (onebits > 29 || bits == onebits) {
+        if (onebits > 7)
+            return -1;
+    }
+    bits -= onebits;
+    if (!bits) {
+        *pbits = 0;
+        return H2HUF_PAD;
+    }
+    tab = h2h_onetab + onebits;
+    if (bits < tab->vallen) {
+        return -2;
+    }
+    val = a>>(bits-tab->vallen) & onevals[tab->vallen];
+    bits -= tab->vallen;
+    if (val > tab->valmax) {
+        if (bits < 1) {
+            return -2;
+        }
+        val <<= 1;
+        if ((a>>(bits-1))&1) {
+            val |= 1;
+        }
+        bits--;
+        if (onebits == 15 && val>13) {
+            if (bits < 1) {
+                return -2;
+            }
+            val <<= 1;
+            if ((a>>(bits-1))&1) {
+                val |= 1;
+            }
+            bits--;
+        }
+    }
+    *pbits = bits;
+    return h2h_vals[tab->valoffset + val];
+}
+
+
+/*
+ * Convert a huffman encoding to a string.
+ * If withclass is set the character classes of the string are accumulated as it is
+ * decoded, so the string can be validated without a second pass.
  * @return the number of bytes in the string or negative to indicate an error
  */
-int h2_huf2str(const char * huf, int huflen, char * str, int slen) {
+static XFORCEINLINE int h2_huf2strCore(const char * huf, int huflen, char * str, int slen,
+        int * pclass, const int withclass) {
     char * instr = str;
     int in_align = !((uintptr_t)huf & 3);  /* Check 4 byte alignment */
-    onetab_t * tab;
     uint64_t a = 0;
-    uint64_t mask;
     int bits = 0;
-    int onebits;
-    int val;
-    uint8_t code;
+    int code;
+    int cls = 0;
 
     while (huflen || bits) {
         if (bits < 32) {
@@ -179,57 +244,91 @@ int h2_huf2str(const char * huf, int huflen, char * str, int slen) {
                 }
             }
         }
-        mask = 1;
-        mask <<= (bits-1);
-        onebits = 0;
-        while (a&mask) {
-            onebits++;
-            mask = mask >> 1;
-        }
-        if (onebits > 29 || bits == onebits) {
-            if (onebits > 7)
-                return -1;
-        }
-        bits -= onebits;
-        if (!bits)
+        code = h2_hufSymbol(a, &bits);
+        if (code == H2HUF_PAD)
             break;
-        tab = h2h_onetab + onebits;
-        if (bits < tab->vallen) {
-            return -2;
-        }
-        val = a>>(bits-tab->vallen) & onevals[tab->vallen];
-        bits -= tab->vallen;
-        if (val > tab->valmax) {
-            if (bits < 1) {
-                return -2;
-            }
-            val <<= 1;
-            if ((a>>(bits-1))&1) {
-                val |= 1;
-            }
-            bits--;
-            if (onebits == 15 && val>13) {
-                if (bits < 1) {
-                    return -2;
-                }
-                val <<= 1;
-                if ((a>>(bits-1))&1) {
-                    val |= 1;
-                }
-                bits--;
-            }
-        }
-        code = h2h_vals[tab->valoffset + val];
-        if (slen) {
+        if (code < 0)
+            return code;
+        if (withclass)
+            cls |= h2_charclass[code];
+        if (slen > 0) {
             *str = (char)code;
         }
         str++;
         slen--;
     }
-    if (slen) {
+    if (slen > 0) {
         *str = 0;
     }
+    if (withclass)
+        *pclass = cls;
     return str-instr;
 }
 
 
+/*
+ * Convert a huffman encoding to a string
+ * @return the number of bytes in the string or negative to indicate an error
+ */
+int h2_huf2str(const char * huf, int huflen, char * str, int slen) {
+    return h2_huf2strCore(huf, huflen, str, slen, NULL, 0);
+}
+
+
+/*
+ * Convert a huffman encoding to a string and return the character classes in it
+ * @return the number of bytes in the string or negative to indicate an error
+ */
+int h2_huf2strClass(const char * huf, int huflen, char * str, int slen, int * pclass) {
+    return h2_huf2strCore(huf, huflen, str, slen, pclass, 1);
+}
+
+
+/*
+ * Convert part of a huffman encoding to a string.
+ * A symbol is only decoded when all of its bits are known, which is when there are at
+ * least 30 bits or the last part has been given, so the encoding can be split anywhere.
+ * The character classes of the decoded bytes are added to the state.
+ * @return the number of bytes written or negative to indicate an error
+ */
+int h2_huf2strPart(h2_hufstate_t * hs, const char * huf, int huflen, char * str, int slen, int last) {
+    uint64_t a = hs->a;
+    int bits = hs->bits;
+    int cls = hs->cls;
+    int count = 0;
+    int code;
+
+    for (;;) {
+        if (bits < 32) {
+            if (huflen >= 4) {
+                a = (a << 32) | h2_read4(huf, 0);
+                bits += 32;
+                huf += 4;
+                huflen -= 4;
+            } else {
+                while (huflen && bits <= 56) {
+                    a = (a << 8) | (uint8_t)*huf++;
+                    bits += 8;
+                    huflen--;
+                }
+            }
+        }
+        if (!bits || (bits < 30 && !last))
+            break;
+        code = h2_hufSymbol(a, &bits);
+        if (code == H2HUF_PAD)
+            break;
+        if (code < 0)
+            return code;
+        if (count >= slen)
+            return -3;
+        cls |= h2_charclass[code];
+        str[count++] = (char)code;
+    }
+    hs->a = a;
+    hs->bits = bits;
+    hs->cls = cls;
+    return count;
+}
+
+
@@ -0,0 +1,79 @@
+/*
+ * Perfect hash tables for the hpack static table.
+ * This file is created by statgen.c and should not be edited.
+ */
+
+#define H2S_NAMEBITS 8
+#define H2S_NAMESEED 0x9e377a51U
+#define H2S_PAIRBITS 5
+#define H2S_PAIRSEED 0x9e3779d3U
+
+/*
+ * Hash of a name with a length of at least 1
+ */
+#define H2S_NAMEHASH(s, len) \
+    ((((uint32_t)(len) << 24) ^ ((uint32_t)(uint8_t)(s)[0] << 16) ^ ((uint32_t)(uint8_t)(s)[(len)>>1] << 8) ^ (uint8_t)(s)[(len)-1]) * H2S_NAMESEED >> (32-H2S_NAMEBITS))
+
+/*
+ * Hash of the first static index of a name and a value with a length of at least 1
+ */
+#define H2S_PAIRHASH(inx, v, len) \
+    ((((uint32_t)(inx) << 24) ^ ((uint32_t)(len) << 16) ^ ((uint32_t)(uint8_t)(v)[0] << 8) ^ (uint8_t)(v)[(len)-1]) * H2S_PAIRSEED >> (32-H2S_PAIRBITS))
+
+/*
+ * Map from name hash to the first static index with the name
+ */
+uint8_t h2s_names [256] = {
+    /* 000 */   0,  0,  0,  0,  0,  8,  0, 51, 60, 21,  0, 49,  0, 25,  0,  0, 
+    /* 010 */   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 
+    /* 020 */   0,  0, 59,  0, 42,  0,  0,  0, 53,  0,  0, 48,  0,  0,  0,  0, 
+    /* 030 */  27,  0, 23, 34,  0,  0, 57,  0,  0,  0, 61,  0,  0,  0,  0,  0, 
+    /* 040 */   0, 46,  0,  0,  0,  0,  0, 20,  0, 18,  0,  0,  0, 36,  0, 50, 
+    /* 050 */   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 
+    /* 060 */   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 37,  0,  0,  0,  0, 
+    /* 070 */   0,  0, 41,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 
+    /* 080 */   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 
+    /* 090 */   0, 38, 44,  0,  0,  0, 55,  4,  0,  0, 33,  0,  0,  0, 24,  0, 
+    /* 0a0 */   0,  0,  0, 16,  0,  0,  0, 47, 31,  0, 52,  0,  0,  0,  0,  0, 
+    /* 0b0 */   0,  0,  0,  0, 43,  0,  1,  0,  0, 40,  0,  0, 35,  0,  0,  0, 
+    /* 0c0 */  29,  0, 28,  0,  0,  0,  0, 58,  0,  0,  0,  0,  0,  0,  0, 32, 
+    /* 0d0 */   0,  0,  0, 19,  0, 45,  0,  0,  0,  0,  0,  0,  0,  0,  2, 54, 
+    /* 0e0 */   0, 22,  6,  0,  0,  0,  0,  0, 26, 56,  0, 17, 15,  0,  0,  0, 
+    /* 0f0 */   0,  0,  0,  0,  0,  0,  0,  0,  0, 30,  0,  0,  0,  0,  0, 39, 
+};
+
+/*
+ * Map from name and value hash to the static index
+ */
+uint8_t h2s_pairs [32] = {
+    /* 000 */   4,  0,  0, 16,  0, 14, 11, 10,  0,  0,  0,  0,  2, 13,  5,  0, 
+    /* 010 */   8,  0,  0,  6,  0,  0,  0,  0,  0,  3,  0,  0,  0,  7, 12,  9, 
+};
+
+/*
+ * The first static index with the same name as each index
+ */
+uint8_t h2s_first [62] = {
+    /* 000 */   0,  1,  2,  2,  4,  4,  6,  6,  8,  8,  8,  8,  8,  8,  8, 15, 
+    /* 016 */  16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 
+    /* 032 */  32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47, 
+    /* 048 */  48, 49, 50, 51, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 
+};
+
+/*
+ * The length of each static name
+ */
+uint8_t h2s_namelen [62] = {
+    /* 000 */   0, 10,  7,  7,  5,  5,  7,  7,  7,  7,  7,  7,  7,  7,  7, 14, 
+    /* 016 */  15, 15, 13,  6, 27,  3,  5, 13, 13, 19, 16, 16, 14, 16, 13, 12, 
+    /* 032 */   6,  4,  4,  6,  7,  4,  4,  8, 17, 13,  8, 19, 13,  4,  8, 12, 
+    /* 048 */  18, 19,  5,  7,  7, 11,  6, 10, 25, 17, 10,  4,  3, 16, 
+};
+
+/*
+ * The length of each static value
+ */
+uint8_t h2s_vallen [17] = {
+    /* 000 */   0,  0,  3,  4,  1, 11,  4,  5,  3,  3,  3,  3,  3,  3,  3,  0, 
+    /* 016 */  13, 
+};
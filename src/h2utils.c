@@ -7,6 +7,103 @@
 #include "h2utils.h"
 
 
+/*
+ * Get a monotonic time in nanoseconds
+ */
+uint64_t h2_nanotime(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if (!freq.QuadPart)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)((double)now.QuadPart * 1000000000.0 / (double)freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/*
+ * The character classes H2CHAR_* of each byte
+ */
+const uint8_t h2_charclass[256] = {
+    0x09, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x09, 0x01, 0x01, 0x09, 0x01, 0x01,   /* 00 */
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,   /* 10 */
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,   /* 20 */
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00,   /* 30 */
+    0x00, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02,   /* 40 */
+    0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00,   /* 50 */
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,   /* 60 */
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01,   /* 70 */
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,   /* 80 */
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,   /* 90 */
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,   /* a0 */
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,   /* b0 */
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,   /* c0 */
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,   /* d0 */
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,   /* e0 */
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,   /* f0 */
+};
+
+
+/*
+ * Check if any byte in a word is zero
+ */
+#define H2_HASZERO(v)  (((v) - 0x0101010101010101ULL) & ~(v) & 0x8080808080808080ULL)
+
+/*
+ * Check if any byte in a word is not allowed in a name or is an uppercase letter or colon.
+ * A byte with the high bit set is found first, and otherwise no byte carries into the
+ * next, so each test sets the high bit of a byte which is below 0x21, at least 0x7f,
+ * from 'A' to 'Z', or a colon.
+ */
+#define H2_ONES        0x0101010101010101ULL
+#define H2_HIGH        0x8080808080808080ULL
+#define H2_NAMECLASS(v) (((v) & H2_HIGH) | (~((v) + 0x5f*H2_ONES) & H2_HIGH) | (((v) + H2_ONES) & H2_HIGH) | \
+        (((v) + 0x3f*H2_ONES) & ~((v) + 0x25*H2_ONES) & H2_HIGH) | (~(((v) ^ 0x3a*H2_ONES) + 0x7f*H2_ONES) & H2_HIGH))
+
+
+/*
+ * Get the character classes in a string
+ */
+int h2_strClass(const char * str, int len, int mask) {
+    int cls = 0;
+    int i;
+
+    /* A value is checked for NUL, CR and LF a word at a time */
+    if (mask == H2CHAR_VALUE) {
+        while (len >= 8) {
+            uint64_t v;
+            memcpy(&v, str, 8);
+            if (H2_HASZERO(v) | H2_HASZERO(v ^ 0x0a0a0a0a0a0a0a0aULL) | H2_HASZERO(v ^ 0x0d0d0d0d0d0d0d0dULL))
+                return H2CHAR_VALUEBAD;
+            str += 8;
+            len -= 8;
+        }
+    }
+
+    /* A name is checked a word at a time, and only a word with a byte of a class by byte */
+    if (mask == H2CHAR_NAME) {
+        while (len >= 8) {
+            uint64_t v;
+            memcpy(&v, str, 8);
+            if (H2_NAMECLASS(v)) {
+                for (i=0; i<8; i++)
+                    cls |= h2_charclass[(uint8_t)str[i]];
+            }
+            str += 8;
+            len -= 8;
+        }
+    }
+    while (len-- > 0)
+        cls |= h2_charclass[(uint8_t)*str++];
+    return cls & mask;
+}
+
+
+
 /*
  * Free an allocation buffer
  */
@@ -69,6 +166,76 @@ char * h2_buffer_alloc(h2_buffer_t * buf, int len, int aligned) {
     return ret;
 }
 
+/*
+ * A heap chunk of an arena
+ */
+typedef struct h2_chunk_t {
+    struct h2_chunk_t * next;
+    char     data[8];
+} h2_chunk_t;
+
+#define H2ARENA_MINCHUNK 4096
+#define H2ARENA_MAXCHUNK (64*1024)
+
+
+/*
+ * Initialize an arena
+ */
+void h2_arena_init(h2_arena_t * arena, char * mem, int len) {
+    arena->first = mem;
+    arena->firstlen = mem ? len : 0;
+    arena->pos = mem;
+    arena->end = mem ? mem + len : NULL;
+    arena->chunks = NULL;
+    arena->chunksize = H2ARENA_MINCHUNK;
+    arena->heapsize = 0;
+}
+
+
+/*
+ * Allocate bytes in an arena.
+ * When the current chunk is full a new chunk is allocated which doubles in size up to
+ * the maximum, or is the size of the allocation if that is larger.
+ */
+char * h2_arena_alloc(h2_arena_t * arena, int len) {
+    h2_chunk_t * chunk;
+    char * ret;
+    int    size;
+
+    if (len <= arena->end - arena->pos) {
+        ret = arena->pos;
+        arena->pos += len;
+        return ret;
+    }
+    size = len > arena->chunksize ? len : arena->chunksize;
+    chunk = malloc(offsetof(h2_chunk_t, data) + size);
+    if (!chunk)
+        return NULL;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->heapsize += size;
+    if (arena->chunksize < H2ARENA_MAXCHUNK)
+        arena->chunksize *= 2;
+    arena->pos = chunk->data + len;
+    arena->end = chunk->data + size;
+    return chunk->data;
+}
+
+
+/*
+ * Free all allocations in an arena
+ */
+void h2_arena_free(h2_arena_t * arena) {
+    h2_chunk_t * chunk = arena->chunks;
+    while (chunk) {
+        h2_chunk_t * next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    h2_arena_init(arena, arena->first, arena->firstlen);
+}
+
+
 /*
  * Put a byte array into a buffer
  */
@@ -104,28 +271,34 @@ static int  maxvals[9] = {0, 1, 3,  7, 15, 31, 63, 127, 255};
  * Put an HPACK integer into a buffer
  */
 int h2_hpack_putInt(h2_buffer_t * buf, uint32_t value, int bits, int upper) {
-    int maxval;
-
     if (bits<1 || bits > 8)
         return -1;
-    maxval = maxvals[bits];
-    upper &= (255-maxval);
-
     if (buf->used + 6 > buf->len) {    /* 6 is the max size value we can encode */
         h2_buffer_ensure(buf, 6);
     }
+    h2_hpack_putIntFast(buf, value, bits, upper);
+    return 0;
+}
+
+
+/*
+ * Put an HPACK integer into a buffer without checking the capacity
+ */
+void h2_hpack_putIntFast(h2_buffer_t * buf, uint32_t value, int bits, int upper) {
+    int maxval = maxvals[bits];
+    upper &= (255-maxval);
 
     if (value < maxval) {
         buf->buf[buf->used++] = (char)(upper | value);
     } else {
-        h2_buffer_put(buf, (char)(upper | maxval));
-        while (value > 128) {
+        buf->buf[buf->used++] = (char)(upper | maxval);
+        value -= maxval;
+        while (value >= 128) {
             buf->buf[buf->used++] = (char)(0x80 | (value&0x7f));
             value >>= 7;
         }
         buf->buf[buf->used++] = (char)value;
     }
-    return 0;
 }
 
 
@@ -161,12 +334,14 @@ int h2_hpack_getInt(h2_buffer_t * buf, uint32_t * value, int bits, int * upper)
             *value = ch&maxval;
             return 1;
         }
-        val = 0;
+        val = maxval;
         shift = 0;
         startpos = buf->pos-1;
         while (buf->pos < buf->used) {
             ch = buf->buf[buf->pos++];
-            val += (ch&0x7f) << shift;
+            if (shift > 28)
+                return -2;           /* Value does not fit in 32 bits */
+            val += (uint32_t)(ch&0x7f) << shift;
             if (ch&0x80) {
                 shift += 7;
             } else {
@@ -187,25 +362,73 @@ int h2_hpack_getInt(h2_buffer_t * buf, uint32_t * value, int bits, int * upper)
  * @param huff  Set to use huffman encoding of the string
  */
 int h2_hpack_putString(h2_buffer_t * buf, const char * str, int len, int huff) {
-    char * abuf = NULL;
-    char * hbuf;
     if (len < 0)
         len = (int)strlen(str);
-    if (huff) {
-        if (len < 4096) {
-            hbuf = alloca(len*4);
-        } else {
-            abuf = hbuf = malloc(len*4);
-        }
-        len = h2_str2huf(str, len, hbuf, len*4);
-        if (len < 0)
-            return len;
-        str = hbuf;
-    }
-    h2_hpack_putInt(buf, len, 7, huff ? 0x80 : 0);
+    if (huff)
+        return h2_hpack_putHufString(buf, str, len);
+    return h2_hpack_putRawString(buf, str, len);
+}
+
+
+/*
+ * Put a string without huffman encoding into a buffer
+ */
+int h2_hpack_putRawString(h2_buffer_t * buf, const char * str, int len) {
+    h2_hpack_putInt(buf, len, 7, 0);
     h2_buffer_putBytes(buf, str, len);
-    if (abuf)
-        free(abuf);
+    return 0;
+}
+
+
+/*
+ * Put a string without huffman encoding into a buffer without checking the capacity
+ */
+void h2_hpack_putRawStringFast(h2_buffer_t * buf, const char * str, int len) {
+    h2_hpack_putIntFast(buf, len, 7, 0);
+    memcpy(buf->buf + buf->used, str, len);
+    buf->used += len;
+}
+
+
+/*
+ * Put a huffman encoded string into a buffer.
+ */
+int h2_hpack_putHufString(h2_buffer_t * buf, const char * str, int len) {
+    int  maxlen = len*4;         /* The longest huffman code is 30 bits */
+
+    if (buf->used + maxlen + 6 > buf->len) {
+        h2_buffer_ensure(buf, maxlen + 6);
+        if (buf->used + maxlen + 6 > buf->len)
+            return -1;
+    }
+    return h2_hpack_putHufStringFast(buf, str, len);
+}
+
+
+/*
+ * Put a huffman encoded string into a buffer without checking the capacity.
+ * The string is encoded directly into the buffer after room for a one byte length, and
+ * is moved in the rare case that the length needs more bytes.
+ */
+int h2_hpack_putHufStringFast(h2_buffer_t * buf, const char * str, int len) {
+    int  hlen;
+    char * out;
+
+    out = buf->buf + buf->used;
+    hlen = h2_str2huf(str, len, out + 1, len*4);
+    if (hlen < 0)
+        return hlen;
+    if (hlen < 127) {
+        *out = (char)(0x80 | hlen);
+        buf->used += hlen + 1;
+    } else {
+        char lenbuf[8];
+        h2_buffer_t lbuf = {lenbuf, sizeof lenbuf};
+        h2_hpack_putIntFast(&lbuf, hlen, 7, 0x80);
+        memmove(out + lbuf.used, out + 1, hlen);
+        memcpy(out, lenbuf, lbuf.used);
+        buf->used += lbuf.used + hlen;
+    }
     return 0;
 }
 
@@ -222,7 +445,7 @@ int h2_hpack_getStringBuf(h2_buffer_t * buf, char * retbuf, int retlen) {
 
     rc = h2_hpack_getInt(buf, &slen, 7, &upper);
     if (rc >= 0) {
-        if (slen > buf->used+buf->pos) {
+        if (slen > (uint32_t)(buf->used - buf->pos)) {
             return -3;
         }
         if (upper&0x80) {
@@ -254,18 +477,32 @@ int h2_hpack_getStringBuf(h2_buffer_t * buf, char * retbuf, int retlen) {
  * or equal to the supplied buffer, then return an allocated value.
  */
 const char * h2_hpack_getString(h2_buffer_t * buf, char * retbuf, int retlen) {
+    int cls = 0;
+    return h2_hpack_getStringClass(buf, retbuf, retlen, &cls);
+}
+
+
+/*
+ * Get a string from a buffer with allocation and return its character classes
+ */
+const char * h2_hpack_getStringClass(h2_buffer_t * buf, char * retbuf, int retlen, int * pclass) {
     int rc;
     uint32_t slen;
     int upper;
+    int mask = *pclass;
 
+    *pclass = 0;
     rc = h2_hpack_getInt(buf, &slen, 7, &upper);
     if (rc >= 0) {
-        if (slen > buf->used+buf->pos) {
+        if (slen > (uint32_t)(buf->used - buf->pos)) {
             return NULL;
         }
         if (upper&0x80) {
             int savepos = buf->pos;
-            rc = h2_huf2str(buf->buf + buf->pos, slen, retbuf, retlen);
+            if (mask)
+                rc = h2_huf2strClass(buf->buf + buf->pos, slen, retbuf, retlen, pclass);
+            else
+                rc = h2_huf2str(buf->buf + buf->pos, slen, retbuf, retlen);
             if (rc < 0)
                 return NULL;
             if (rc >= retlen) {
@@ -275,6 +512,7 @@ const char * h2_hpack_getString(h2_buffer_t * buf, char * retbuf, int retlen) {
                 rc = h2_huf2str(buf->buf + buf->pos, slen, retbuf, retlen);
             }
             buf->pos += slen;
+            *pclass &= mask;
             return retbuf;
         } else {
             if (slen >= retlen)
@@ -282,6 +520,8 @@ const char * h2_hpack_getString(h2_buffer_t * buf, char * retbuf, int retlen) {
             memcpy(retbuf, buf->buf + buf->pos, slen);
             retbuf[slen] = 0;
             buf->pos += slen;
+            if (mask)
+                *pclass = h2_strClass(retbuf, slen, mask);
             return retbuf;
         }
     }
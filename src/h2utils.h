@@ -56,12 +56,95 @@ typedef unsigned __int64 uint64_t;
 
 #define XINLINE __inline__
 
+/* Inline even when the compiler would not, used to specialize a function for constant arguments */
+#if defined(__GNUC__)
+    #define XFORCEINLINE __inline__ __attribute__ (( always_inline ))
+#elif defined(_MSC_VER)
+    #define XFORCEINLINE __forceinline
+#else
+    #define XFORCEINLINE XINLINE
+#endif
+
+/*
+ * Character classes used to validate header field names and values (RFC 9113 8.2.1).
+ * A name must not contain controls, space, DEL, non-ASCII or uppercase letters, and may
+ * only have a colon as its first character.  A value must not contain NUL, CR or LF.
+ */
+#define H2CHAR_NAMEBAD   0x01      /* Not allowed in a name                      */
+#define H2CHAR_UPPER     0x02      /* Uppercase letter                           */
+#define H2CHAR_COLON     0x04      /* Colon, only allowed to start a name        */
+#define H2CHAR_VALUEBAD  0x08      /* Not allowed in a value                     */
+#define H2CHAR_NAME      (H2CHAR_NAMEBAD | H2CHAR_UPPER | H2CHAR_COLON)
+#define H2CHAR_VALUE     H2CHAR_VALUEBAD
+extern const uint8_t h2_charclass[256];
+
+/*
+ * Simple lock used for process wide state
+ */
+#ifdef _WIN32
+#include <windows.h>
+typedef SRWLOCK h2_lock_t;
+#define H2_LOCK_INIT     SRWLOCK_INIT
+#define h2_lock(l)       AcquireSRWLockExclusive(l)
+#define h2_unlock(l)     ReleaseSRWLockExclusive(l)
+#else
+#include <pthread.h>
+typedef pthread_mutex_t h2_lock_t;
+#define H2_LOCK_INIT     PTHREAD_MUTEX_INITIALIZER
+#define h2_lock(l)       pthread_mutex_lock(l)
+#define h2_unlock(l)     pthread_mutex_unlock(l)
+#endif
+
+/*
+ * Load and store used to publish process wide state which is read without a lock.
+ * On Windows a volatile access has acquire and release semantics.
+ */
+#ifdef _WIN32
+#define h2_load_acquire(p)      (*(p))
+#define h2_store_release(p, v)  (*(p) = (v))
+#else
+#define h2_load_acquire(p)      __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define h2_store_release(p, v)  __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#endif
+
+/*
+ * Add to a 64 bit counter which is updated by more than one thread
+ */
+#ifdef _WIN32
+#define h2_atomic_add64(p, v)   InterlockedExchangeAdd64((volatile LONG64 *)(p), (LONG64)(v))
+#else
+#define h2_atomic_add64(p, v)   __atomic_fetch_add(p, v, __ATOMIC_RELAXED)
+#endif
+
+/*
+ * Increment a 16 bit counter which is updated by more than one thread, and return the new value
+ */
+#ifdef _WIN32
+#define h2_atomic_inc16(p)      ((uint16_t)InterlockedIncrement16((volatile SHORT *)(p)))
+#else
+#define h2_atomic_inc16(p)      __atomic_add_fetch(p, 1, __ATOMIC_RELAXED)
+#endif
+
+/*
+ * Set a 32 bit value if it has the expected value, and return whether it was set
+ */
+#ifdef _WIN32
+#define h2_atomic_cas32(p, o, v) (InterlockedCompareExchange((volatile LONG *)(p), (LONG)(v), (LONG)(o)) == (LONG)(o))
+#else
+#define h2_atomic_cas32(p, o, v) __sync_bool_compare_and_swap(p, o, v)
+#endif
+
 #include <string.h>
 #include <errno.h>
 #include <malloc.h>
 #include <stdarg.h>
 #include <time.h>
 
+/*
+ * Get a monotonic time in nanoseconds
+ */
+uint64_t h2_nanotime(void);
+
 /*
  * Structure for allocated memory for a result buffer.
  * This is designed so that the buffer can be put on the stack, but if it overflows
@@ -78,6 +161,76 @@ typedef struct h2_buffer_t {
 } h2_buffer_t;
 
 
+/*
+ * A bump allocator for memory which is freed all at once.
+ * The first chunk can be supplied by the caller, for instance on the stack, and more
+ * chunks are allocated in the heap as needed.  Unlike a buffer the memory is never
+ * moved, so allocations stay valid until the arena is freed.
+ */
+typedef struct h2_arena_t {
+    char *   pos;                  /**< The next free byte in the current chunk   */
+    char *   end;                  /**< The end of the current chunk              */
+    struct h2_chunk_t * chunks;    /**< The chunks in the heap, newest first      */
+    int      chunksize;            /**< The size of the next heap chunk           */
+    int      heapsize;             /**< The bytes allocated in the heap           */
+    char *   first;                /**< The memory supplied by the caller         */
+    int      firstlen;             /**< The length of the supplied memory         */
+} h2_arena_t;
+
+
+/*
+ * Initialize an arena.
+ *
+ * @param arena  The arena
+ * @param mem    The first chunk or NULL
+ * @param len    The length of the first chunk
+ */
+void h2_arena_init(h2_arena_t * arena, char * mem, int len);
+
+
+/*
+ * Allocate bytes in an arena.
+ *
+ * @param arena  The arena
+ * @param len    The number of bytes
+ * @return The allocated bytes or NULL if the allocation fails
+ */
+char * h2_arena_alloc(h2_arena_t * arena, int len);
+
+
+/*
+ * Return the end of the last allocation in an arena.
+ * This is used when fewer bytes than were allocated are used.
+ *
+ * @param arena  The arena
+ * @param mem    The last allocation
+ * @param len    The number of bytes which are used
+ */
+#define h2_arena_trim(arena, mem, len) \
+    ((arena)->pos = (mem) + (len))
+
+
+/*
+ * Free all allocations in an arena.
+ * The heap chunks are freed and the arena can be used again.
+ *
+ * @param arena  The arena
+ */
+void h2_arena_free(h2_arena_t * arena);
+
+
+/*
+ * Get the character classes in a string.
+ * When only the value classes are wanted the string is checked 8 bytes at a time.
+ *
+ * @param str   The string
+ * @param len   The length of the string
+ * @param mask  The classes H2CHAR_* to look for
+ * @return The classes found in the string which are in the mask
+ */
+int h2_strClass(const char * str, int len, int mask);
+
+
 /*
  * Free any heap memory associated with a buffer.
  *
@@ -153,6 +306,17 @@ void h2_buffer_putString(h2_buffer_t * buf, const char * str);
  */
 const char * h2_hpack_getString(h2_buffer_t * buf, char * retbuf, int retlen);
 
+/*
+ * Get a string from a buffer with allocation and return its character classes.
+ * This is the same as h2_hpack_getString, and the classes are found as the string is
+ * decoded or copied.
+ * @param buf     The buffer containing the hpack
+ * @param retbuf  The buffer to return the string
+ * @param retlen  The length of the return buffer
+ * @param pclass  The classes H2CHAR_* to look for, and the classes found (output)
+ */
+const char * h2_hpack_getStringClass(h2_buffer_t * buf, char * retbuf, int retlen, int * pclass);
+
 
 /*
  * Get a string from a buffer with truncation
@@ -174,11 +338,40 @@ int h2_hpack_getStringBuf(h2_buffer_t * buf, char * retbuf, int retlen);
  */
 int h2_hpack_putString(h2_buffer_t * buf, const char * str, int len, int huff);
 
+/*
+ * Put an HPACK string into a buffer without huffman encoding
+ * @param buf   The buffer
+ * @param str   The string to put
+ * @param len   The length of the string
+ */
+int h2_hpack_putRawString(h2_buffer_t * buf, const char * str, int len);
+
+/*
+ * Put an HPACK string into a buffer with huffman encoding
+ * @param buf   The buffer
+ * @param str   The string to put
+ * @param len   The length of the string
+ */
+int h2_hpack_putHufString(h2_buffer_t * buf, const char * str, int len);
+
 /*
  * Put an HPACK integer into a buffer
  */
 int h2_hpack_putInt(h2_buffer_t * buf, uint32_t value, int bits, int upper);
 
+/*
+ * Put functions which do not check the capacity of the buffer.
+ * These are used when the caller has already made room for the largest output,
+ * which is 6 bytes for an integer and 6 bytes plus 4 times the length for a string.
+ */
+#define h2_buffer_putFast(buf, ch) \
+    ((buf)->buf[(buf)->used++] = (char)(ch))
+#define h2_buffer_putBytesFast(buf, bytes, len) \
+    (memcpy((buf)->buf + (buf)->used, (bytes), (len)), (buf)->used += (len))
+void h2_hpack_putIntFast(h2_buffer_t * buf, uint32_t value, int bits, int upper);
+void h2_hpack_putRawStringFast(h2_buffer_t * buf, const char * str, int len);
+int h2_hpack_putHufStringFast(h2_buffer_t * buf, const char * str, int len);
+
 
 /*
  * Get an HPACK integer
@@ -191,6 +384,40 @@ int h2_hpack_getInt(h2_buffer_t * buf, uint32_t * value, int bits, int * upper);
 int h2_huf2str(const char * huf, int huflen, char * str, int slen);
 
 
+/*
+ * Convert a huffman encoding to a string and return the character classes in it.
+ * @param huf     The huffman encoding
+ * @param huflen  The length of the encoding
+ * @param str     The output location
+ * @param slen    The room at the output location
+ * @param pclass  The character classes H2CHAR_* in the string (output)
+ * @return The number of bytes in the string or negative to indicate an error
+ */
+int h2_huf2strClass(const char * huf, int huflen, char * str, int slen, int * pclass);
+
+
+/*
+ * The state of a huffman encoding which is decoded in parts
+ */
+typedef struct h2_hufstate_t {
+    uint64_t a;                    /**< The bits not yet decoded                  */
+    int      bits;                 /**< The number of bits                        */
+    int      cls;                  /**< The character classes decoded H2CHAR_*    */
+} h2_hufstate_t;
+
+/*
+ * Convert part of a huffman encoding to a string.
+ * The state must be zero before the first part.
+ * @param hs      The huffman state
+ * @param huf     The part of the huffman encoding
+ * @param huflen  The length of the part
+ * @param str     The output location
+ * @param slen    The room at the output location
+ * @param last    Set if this is the last part
+ * @return The number of bytes written or negative to indicate an error
+ */
+int h2_huf2strPart(h2_hufstate_t * hs, const char * huf, int huflen, char * str, int slen, int last);
+
 /*
  *
  */
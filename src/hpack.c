@@ -1,20 +1,66 @@
 #include "h2utils.h"
 #include "hpack.h"
+#include "h2static.h"
 
 /*
  * HTTP/2 defines the entry to have 32 bytes of overhead.  We use this a two pointer,
- * two short length fields, two null bytes, and pad of up to 7 bytes as we keep the entries
- * 8 byte aligned.
+ * two short length fields, the name type and index, two null bytes, and pad of up to
+ * 7 bytes as we keep the entries 8 byte aligned.
+ *
+ * The name is not always kept in the entry.  A name from the static table is kept as
+ * its index, and a name which is also used by another entry can be kept as a pointer
+ * to a shared name.  In both cases only the value follows the entry header.  This does
+ * not change the entry size used for the table size, which is always 32 plus the
+ * length of the name and value.
  */
 typedef struct h2_entry_t {
     struct h2_entry_t * next;
     struct h2_entry_t * prev;
     uint16_t hdrlen;
     uint16_t valuelen;
-    uint8_t  inheap;
-    char     hdr[11];
+    uint8_t  nametype;                    /* H2NAME_INLINE, H2NAME_STATIC, or H2NAME_SHARED */
+    uint8_t  nameinx;                     /* The static table index, or the header ID for other names */
+    char     hdr[10];                     /* The name (for H2NAME_INLINE) followed by the value */
 } h2_entry_t;
 
+#define H2NAME_INLINE   0                 /* The name is in the entry before the value */
+#define H2NAME_STATIC   1                 /* The name is in the static table */
+#define H2NAME_SHARED   2                 /* The entry points to a shared name */
+#define H2NAME_MINSHARE 8                 /* Shorter names are copied rather than shared */
+#define H2NAME_INTERNED 0xffffffff        /* The reference count of an interned name */
+
+
+/*
+ * A header name shared by dynamic table entries.
+ * A shared name is created when an entry is added with the same name as an existing
+ * entry, and is freed when the last entry using it is evicted.  An interned name is
+ * shared by all contexts, is not reference counted, and is never freed.
+ */
+typedef struct h2_name_t {
+    uint32_t refs;                        /* The number of entries using the name */
+    uint16_t len;                         /* The length of the name */
+    char     name[];                      /* The null terminated name */
+} h2_name_t;
+
+
+/*
+ * The name of an entry to be added to the dynamic table
+ */
+typedef struct h2_newname_t {
+    const char * name;                    /* The name */
+    int          len;                     /* The length of the name */
+    uint8_t      type;                    /* H2NAME_INLINE, H2NAME_STATIC, or H2NAME_SHARED */
+    uint8_t      inx;                     /* The static table index or the header ID */
+    h2_name_t *  shared;                  /* The shared name */
+} h2_newname_t;
+
+
+/*
+ * Encode one header field
+ */
+typedef void (* h2_encodeField_f)(h2_context_t * h2ctx, const char * hdr, int hdrlen,
+        const char * value, int vallen, h2_buffer_t * buf);
+
 
 /*
  * The HTTP/2 hpack context.
@@ -33,13 +79,170 @@ struct h2_context_t {
     uint32_t current_size;                /* The crrent size (can be reduced by encoder) */
     uint32_t max_entry_size;              /* The max entry size for encode */
     uint32_t entries;                     /* The number of entries */
+    uint32_t inserts;                     /* The number of entries ever added */
     uint8_t  encode_opt;                  /* Encodeer options */
     uint8_t  decode_opt;                  /* Decode options */
     uint8_t  usehuff;                     /* Huffman options (oonly used in encoder) */
     uint8_t  encode;                      /* 0=decode 1=encode */
+    uint8_t  pending_update;              /* A table size update is to be sent */
+    uint8_t  resv[3];
+    uint32_t pending_min;                 /* The smallest size since the last header block */
+    uint32_t pending_size;                /* The size to send in the table size update */
+    uint32_t blocks;                      /* Header blocks encoded */
+    uint32_t fields;                      /* Header fields encoded */
+    uint32_t hits;                        /* Header fields found in the dynamic table */
+    struct h2_context_t * gov_next;       /* Governor list of contexts */
+    struct h2_context_t * gov_prev;
+    uint32_t gov_blocks;                  /* Blocks at the last governor check */
+    uint32_t gov_fields;                  /* Fields at the last governor check */
+    uint32_t gov_hits;                    /* Hits at the last governor check */
+    uint32_t gov_idle;                    /* Governor checks without activity */
+    uint32_t gov_value;                   /* Value of the table at the last governor check */
+    volatile uint32_t gov_target;         /* Table size requested by the governor */
+    volatile uint8_t  gov_pending;        /* The governor has requested a table size */
+    volatile uint32_t gov_owner;          /* H2OWNER_ for the thread changing the table */
+    uint8_t  gov_reduced;                 /* The governor has reduced the table */
+    uint32_t app_size;                    /* The table size set by the application */
+    struct h2_grpc_t * grpc;              /* The gRPC profile or NULL */
+    h2_encodeField_f encodeField;         /* Encode one field */
+    h2_encodeField_f encodeVariant;       /* Encode one field specialized for the options */
+    h2_encodeField_f encodeFast;          /* Encode one field without checking the buffer capacity */
+    uint8_t * policy;                     /* The indexing policy by header ID */
+    struct h2_memo_t * memo;              /* The encoded field memo or NULL */
+    uint32_t generation;                  /* Incremented when the table entries are moved */
+    uint32_t memo_policy;                 /* The policy generation when the memo was checked */
+    uint32_t policy_serial;               /* Incremented when the context options or policies change */
+    const char * rawval;                  /* The huffman encoded value of the field being encoded */
+    int      rawlen;                      /* The length of the huffman encoded value */
+    uint8_t  full_opt;                    /* The encoder options at the full load level */
+    uint8_t  full_huff;                   /* The huffman option at the full load level */
+    uint8_t  load_level;                  /* The load level the options are set for */
+    uint8_t  limits;                      /* Any decode limit is set */
+    uint64_t load_start;                  /* The time the current encode started */
+    uint32_t max_list;                    /* The largest decoded header list size, 0=no limit */
+    uint32_t max_fields;                  /* The most decoded fields in a block, 0=no limit */
+    uint32_t max_field;                   /* The largest decoded field, 0=no limit */
+    struct h2_track_t * track;            /* The names tracked by hpack_decodeTrack or NULL */
+};
+
+
+/*
+ * The use of the decode limits by a header block
+ */
+typedef struct h2_use_t {
+    uint64_t list;                        /* The header list size so far */
+    uint32_t fields;                      /* The fields so far */
+} h2_use_t;
+
+
+/*
+ * The process wide memory governor.
+ * This keeps the list of all contexts and the total bytes allocated for their
+ * dynamic tables.  An encoder is owned by the thread encoding a block, so the
+ * governor only changes the table of an encoder it can take ownership of.  For
+ * an encoder which is in use it requests a new table size, which the encoder
+ * applies at the start of its next header block.  Decoder tables are outside the
+ * budget as only the peer can change them.
+ */
+static struct {
+    h2_lock_t      lock;
+    h2_context_t * head;                  /* The list of contexts */
+    uint64_t       budget;                /* The memory budget or 0 for none */
+    uint64_t       used;                  /* The bytes allocated for encoder tables */
+    uint64_t       decoders;              /* The bytes allocated for decoder tables */
+    uint32_t       contexts;              /* The number of contexts */
+    uint32_t       shrinks;               /* Table size reductions requested */
+    uint32_t       grows;                 /* Table size increases requested */
+} h2_gov = { H2_LOCK_INIT };
+
+/* The owner of an encoder table */
+#define H2OWNER_NONE     0
+#define H2OWNER_ENCODE   1                /* The thread encoding a block */
+#define H2OWNER_GOVERNOR 2                /* The memory governor */
+
+
+/*
+ * The process wide encoder load controller.
+ * The level is read by each encoder at the start of a header block, so as with the
+ * memory governor a context is only changed by the thread using it.
+ */
+static struct {
+    h2_lock_t      lock;
+    uint64_t       high;                  /* The load which raises the level, 0=disabled */
+    uint64_t       low;                   /* The load which lowers the level */
+    volatile uint64_t encode_ns;          /* Time spent encoding */
+    volatile uint32_t level;              /* The load level */
+    uint32_t       changes;               /* Level changes */
+    volatile uint8_t timing;              /* Measure the encode time */
+} h2_adapt = { H2_LOCK_INIT };
+
+
+/*
+ * The extra well known header names.
+ * The names are found using a small open addressed hash table which holds the
+ * index of the name plus one.  This is set before use and is then only read.
+ */
+#define H2ID_HASHSIZE 256
+static struct {
+    char *   names[H2ID_MAXEXTRA];        /* The names, or NULL if not used */
+    uint16_t lens[H2ID_MAXEXTRA];         /* The length of each name */
+    uint8_t  slot[H2ID_HASHSIZE];         /* Name index plus one, or 0 for an empty slot */
+    int      count;                       /* The number of names */
+} h2_extra;
+
+
+/*
+ * The process wide interned name pool.
+ *
+ * Names which are seen often are added to the pool and given a header ID starting at
+ * H2ID_INTERN, and dynamic table entries with the name point to the interned copy.
+ * Lookup does not lock.  A name is added under the lock by setting its pointer and
+ * then publishing its slot in the hash table, and names are never removed, so a
+ * reader always sees a complete name.  The number of times an encoder sees a name is
+ * counted in a small table of counters indexed by the name hash, so the counts are
+ * approximate.  Names sent by a peer are not counted, so a peer cannot fill the pool.
+ */
+#define H2INTERN_HASHSIZE 256
+#define H2INTERN_COUNTERS 1024
+#define H2INTERN_MAXLEN   64
+#define H2INTERN_DEFAULT  64
+static struct {
+    h2_lock_t     lock;                   /* Serialize adding names */
+    h2_name_t *   names[H2ID_MAXINTERN];  /* The interned names by ID */
+    volatile uint8_t  slot[H2INTERN_HASHSIZE];  /* Name index plus one, or 0 for an empty slot */
+    volatile int      count;              /* The number of interned names */
+    volatile uint32_t threshold;          /* Times a name is seen before it is interned, 0=never */
+    volatile uint16_t seen[H2INTERN_COUNTERS];  /* Approximate times names were seen */
+} h2_intern = { H2_LOCK_INIT, {0}, {0}, 0, H2INTERN_DEFAULT };
+
+
+/*
+ * The default encoder indexing policy by header ID.
+ * Names which do not have an ID use H2POLICY_INDEX.  Names which are not in the static
+ * table are interned to give them an ID when the first context is created.
+ */
+static uint8_t h2_policy_default[256];
+static uint8_t h2_policy_init;
+static volatile uint32_t h2_policy_gen;   /* Incremented when a policy is changed */
+static const struct {
+    const char * name;
+    uint8_t      policy;
+} h2_policy_names[] = {
+    {"authorization",        H2POLICY_NEVER},
+    {"proxy-authorization",  H2POLICY_NEVER},
+    {"date",                 H2POLICY_NOINDEX},
+    {"content-length",       H2POLICY_NOINDEX},
+    {"x-request-id",         H2POLICY_NOINDEX},
+    {"traceparent",          H2POLICY_NOINDEX},
+    {"x-b3-traceid",         H2POLICY_NOINDEX},
+    {"x-b3-spanid",          H2POLICY_NOINDEX},
+    {NULL,                   0},
 };
 
 
+typedef struct h2_route_t h2_route_t;
+
+
 /*
  * Internal functions
  */
@@ -47,8 +250,60 @@ int hpack_reduceDynamic(h2_context_t * h2ctx, int size);
 int hpack_changeDynamic(h2_context_t * h2ctx, int size);
 int hpack_canonicalize(char * buf, int len);
 int hpack_pushDynamic(h2_context_t * h2ctx, const char * hdr, const char * value);
+int hpack_insertDynamic(h2_context_t * h2ctx, const char * hdr, int hdrlen, const char * value, int vallen);
 int hpack_lookupDynamic(h2_context_t * h2ctx, const char * hdr, const char * value);
 int hpack_lookupStatic(const char * hdr, const char * value);
+int hpack_lookupStaticLen(const char * hdr, int hdrlen, const char * value, int vallen);
+int hpack_resizeTable(h2_context_t * h2ctx, int alloc);
+static int hpack_nextWhere(h2_context_t * h2ctx);
+static void hpack_linkEntry(h2_context_t * h2ctx, h2_entry_t * ent, int hdrlen, int vallen);
+static h2_entry_t * hpack_getEntry(h2_context_t * h2ctx, uint32_t inx);
+static int hpack_decodeBlock(h2_context_t * h2ctx, const char * src, int slen, h2_buffer_t * buf,
+        h2_field_t * fields, int maxfields);
+static int hpack_decodeInsert(h2_context_t * h2ctx, h2_buffer_t * sbuf, uint32_t index,
+        const char * * hdr, int * hdrlen, const char * * value, int * vallen, char * * tofree,
+        const char * * raw, int * rawlen);
+static void hpack_governorApply(h2_context_t * h2ctx);
+static int hpack_getLiteral(h2_buffer_t * sbuf, const char * * str, int * huff);
+static int hpack_putLiteral(char * out, const char * str, int len, int huff, int mask);
+static int hpack_checkClass(int cls, const char * str, int len);
+static int hpack_nameBytes(int nametype, int hdrlen);
+static h2_entry_t * hpack_reserveDynamic(h2_context_t * h2ctx, int need);
+static int hpack_decodeRefBlock(h2_context_t * h2ctx, const char * src, int slen, h2_buffer_t * buf,
+        h2_arena_t * arena, int lazy, h2_route_t * rt, h2_fieldref_t * refs, int maxrefs);
+static void hpack_startBlock(h2_context_t * h2ctx, h2_buffer_t * buf);
+static void hpack_loadApply(h2_context_t * h2ctx);
+static void hpack_timeStart(h2_context_t * h2ctx);
+static void hpack_timeEnd(h2_context_t * h2ctx);
+static void hpack_endBlock(h2_context_t * h2ctx);
+static int  hpack_serialize(h2_context_t * h2ctx, h2_buffer_t * buf);
+static int  hpack_tableSize(h2_context_t * h2ctx, int size);
+static void hpack_claimTable(h2_context_t * h2ctx);
+static void hpack_releaseTable(h2_context_t * h2ctx);
+static int hpack_encodeLines(h2_context_t * h2ctx, char * src, int len, h2_buffer_t * buf);
+static void hpack_encodeField(h2_context_t * h2ctx, const char * hdr, int hdrlen, const char * value,
+        int vallen, h2_buffer_t * buf);
+static void hpack_selectEncoder(h2_context_t * h2ctx);
+static void hpack_clearMemo(h2_context_t * h2ctx);
+static int hpack_grpcField(h2_context_t * h2ctx, const char * hdr, int hdrlen, const char * value,
+        int vallen, h2_buffer_t * buf);
+static int hpack_grpcFixed(h2_context_t * h2ctx, int which, h2_buffer_t * buf);
+static void hpack_initPolicy(void);
+static int hpack_templateCompile(h2_context_t * h2ctx, h2_template_t * tmpl);
+static int hpack_entrySize(const h2_entry_t * ent);
+static const char * hpack_entryName(const h2_entry_t * ent);
+static h2_name_t * hpack_entryShared(const h2_entry_t * ent);
+static char * hpack_entryValue(const h2_entry_t * ent);
+static void hpack_resolveName(h2_newname_t * nn, const char * hdr, int hdrlen, int id, const h2_entry_t * src);
+static void hpack_releaseName(h2_name_t * shared);
+static int hpack_nameId(const char * name, int len, int observe);
+static int hpack_pushEntry(h2_context_t * h2ctx, h2_newname_t * nn, const char * value, int vallen);
+static XFORCEINLINE int hpack_pushEntryOpt(h2_context_t * h2ctx, h2_newname_t * nn, const char * value,
+        int vallen, const int opt);
+static int hpack_insertName(h2_context_t * h2ctx, h2_newname_t * nn, const char * value, int vallen);
+static int hpack_findDynamic(h2_context_t * h2ctx, const char * hdr, int hdrlen, const char * value,
+        int vallen, int id, h2_entry_t * * nament);
+static char * hpack_putName(h2_entry_t * ent, h2_newname_t * nn);
 const char * hpack_getHeader(h2_context_t * h2ctx, int inx);
 const char * hpack_getValue(h2_context_t * h2ctx, int inx);
 
@@ -161,21 +416,52 @@ h2_context_t * hpack_newContext(int size, int encode, int maxentry, int options,
         return NULL;
     }
 
-    h2ctx = malloc(sizeof(h2_context_t) + size + maxentry);
+    h2ctx = malloc(sizeof(h2_context_t));
+    if (!h2ctx)
+        return NULL;
     memset(h2ctx, 0, sizeof(h2_context_t));
+    if (size + maxentry) {
+        h2ctx->dyntab = malloc(size + maxentry);
+        if (!h2ctx->dyntab) {
+            free(h2ctx);
+            return NULL;
+        }
+    }
     h2ctx->encode = !!encode;
-    h2ctx->dyntab = (char *)(h2ctx+1);
     h2ctx->alloc_size = size + maxentry;
     h2ctx->declare_size = size;
     h2ctx->current_size = size;
+    h2ctx->app_size = size;
     h2ctx->max_entry_size = maxentry;
     h2ctx->usehuff = (uint8_t)huff;
     if (h2ctx->encode) {
         h2ctx->encode_opt = (uint8_t)options;
+        h2ctx->full_opt = h2ctx->encode_opt;
+        h2ctx->full_huff = h2ctx->usehuff;
     } else {
         h2ctx->encode_opt = (uint8_t)H2ENCODE_MAX;
         h2ctx->decode_opt = (uint8_t)options;
     }
+    hpack_selectEncoder(h2ctx);
+    if (h2ctx->encode)
+        hpack_setMemo(h2ctx, 1);
+
+    if (!h2_policy_init)
+        hpack_initPolicy();
+    h2ctx->policy = h2_policy_default;
+
+    /* Add to the governor */
+    h2_lock(&h2_gov.lock);
+    h2ctx->gov_next = h2_gov.head;
+    if (h2_gov.head)
+        h2_gov.head->gov_prev = h2ctx;
+    h2_gov.head = h2ctx;
+    if (h2ctx->encode)
+        h2_gov.used += h2ctx->alloc_size;
+    else
+        h2_gov.decoders += h2ctx->alloc_size;
+    h2_gov.contexts++;
+    h2_unlock(&h2_gov.lock);
     return h2ctx;
 }
 
@@ -184,6 +470,30 @@ h2_context_t * hpack_newContext(int size, int encode, int maxentry, int options,
  * @param h2ctx  The hpack context
  */
 void hpack_freeContext(h2_context_t * h2ctx) {
+    h2_lock(&h2_gov.lock);
+    if (h2ctx->gov_prev)
+        h2ctx->gov_prev->gov_next = h2ctx->gov_next;
+    else
+        h2_gov.head = h2ctx->gov_next;
+    if (h2ctx->gov_next)
+        h2ctx->gov_next->gov_prev = h2ctx->gov_prev;
+    if (h2ctx->encode)
+        h2_gov.used -= h2ctx->alloc_size;
+    else
+        h2_gov.decoders -= h2ctx->alloc_size;
+    h2_gov.contexts--;
+    h2_unlock(&h2_gov.lock);
+    h2ctx->current_size = 0;
+    hpack_reduceDynamic(h2ctx, 0);          /* Release shared names */
+    if (h2ctx->dyntab)
+        free(h2ctx->dyntab);
+    if (h2ctx->grpc)
+        free(h2ctx->grpc);
+    if (h2ctx->policy != h2_policy_default)
+        free(h2ctx->policy);
+    if (h2ctx->track)
+        free(h2ctx->track);
+    hpack_setMemo(h2ctx, 0);
     free(h2ctx);
 }
 
@@ -210,6 +520,204 @@ int hpack_getContextStats(h2_context_t * h2ctx, int * maxsize, int * currentsize
 }
 
 
+
+/*
+ * Version of the serialized context.
+ * The serialized form is:
+ *   'H' version flags encode_opt decode_opt usehuff pending_update
+ *   declare_size current_size max_entry_size entries     (as hpack integers)
+ *   pending_min pending_size                   (only if pending_update is set)
+ *   policies followed by that many namelen name policy      (encoder only)
+ *   max_list max_fields max_field                  (decode limits, 0 for an encoder)
+ *   entries from oldest to newest as hdrlen hdr vallen value
+ * Interned header IDs are specific to a process, so a policy is written with its name.
+ */
+#define H2SER_MAGIC    'H'
+#define H2SER_VERSION  4
+
+
+/*
+ * Serialize the state of an hpack context.
+ *
+ * The context does not contain any thread or process specific state, so the
+ * serialized form can be restored in another process (for instance across a binary
+ * upgrade) or used to compact the table when a connection moves between threads.
+ * Writing the entries from oldest to newest lets the restore simply insert them.
+ */
+int hpack_serializeContext(h2_context_t * h2ctx, h2_buffer_t * buf) {
+    int rc;
+
+    if (!h2ctx->encode)
+        return hpack_serialize(h2ctx, buf);
+    hpack_claimTable(h2ctx);              /* The governor can change an encoder table */
+    rc = hpack_serialize(h2ctx, buf);
+    hpack_releaseTable(h2ctx);
+    return rc;
+}
+
+static int hpack_serialize(h2_context_t * h2ctx, h2_buffer_t * buf) {
+    h2_entry_t * ent;
+    int startused = buf->used;
+    int policies = 0;
+    int polsize = 0;
+    int id;
+
+    /* Only the policies which differ from the process default are written */
+    if (h2ctx->encode && h2ctx->policy != h2_policy_default) {
+        for (id = 1; id < 256; id++) {
+            if (h2ctx->policy[id] != h2_policy_default[id] && hpack_getHeaderName(id)) {
+                policies++;
+                polsize += 2 + (int)strlen(hpack_getHeaderName(id));
+            }
+        }
+    }
+    h2_buffer_ensure(buf, 48 + polsize + h2ctx->used_size);
+    if (buf->used + 48 + polsize > buf->len)
+        return -1;
+    buf->buf[buf->used++] = H2SER_MAGIC;
+    buf->buf[buf->used++] = H2SER_VERSION;
+    buf->buf[buf->used++] = (char)h2ctx->encode;
+    buf->buf[buf->used++] = (char)(h2ctx->encode ? h2ctx->full_opt : h2ctx->encode_opt);
+    buf->buf[buf->used++] = (char)h2ctx->decode_opt;
+    buf->buf[buf->used++] = (char)(h2ctx->encode ? h2ctx->full_huff : h2ctx->usehuff);
+    buf->buf[buf->used++] = (char)h2ctx->pending_update;
+    h2_hpack_putInt(buf, h2ctx->declare_size, 8, 0);
+    h2_hpack_putInt(buf, h2ctx->current_size, 8, 0);
+    h2_hpack_putInt(buf, h2ctx->max_entry_size, 8, 0);
+    h2_hpack_putInt(buf, h2ctx->entries, 8, 0);
+    if (h2ctx->pending_update) {
+        h2_hpack_putInt(buf, h2ctx->pending_min, 8, 0);
+        h2_hpack_putInt(buf, h2ctx->pending_size, 8, 0);
+    }
+    h2_hpack_putInt(buf, policies, 8, 0);
+    for (id = 1; policies && id < 256; id++) {
+        const char * name = hpack_getHeaderName(id);
+        if (h2ctx->policy[id] != h2_policy_default[id] && name) {
+            h2_hpack_putInt(buf, (uint32_t)strlen(name), 8, 0);
+            h2_buffer_putBytes(buf, name, (int)strlen(name));
+            buf->buf[buf->used++] = (char)h2ctx->policy[id];
+        }
+    }
+    h2_hpack_putInt(buf, h2ctx->max_list, 8, 0);
+    h2_hpack_putInt(buf, h2ctx->max_fields, 8, 0);
+    h2_hpack_putInt(buf, h2ctx->max_field, 8, 0);
+
+    ent = h2ctx->tail;
+    while (ent) {
+        h2_hpack_putInt(buf, ent->hdrlen, 8, 0);
+        h2_buffer_putBytes(buf, hpack_entryName(ent), ent->hdrlen);
+        h2_hpack_putInt(buf, ent->valuelen, 8, 0);
+        h2_buffer_putBytes(buf, hpack_entryValue(ent), ent->valuelen);
+        ent = ent->prev;
+    }
+    return buf->used - startused;
+}
+
+
+/*
+ * Restore an hpack context from its serialized form.
+ */
+h2_context_t * hpack_restoreContext(const char * src, int slen) {
+    h2_context_t * h2ctx;
+    uint32_t declare_size;
+    uint32_t current_size;
+    uint32_t max_entry_size;
+    uint32_t entries;
+    uint32_t hdrlen;
+    uint32_t vallen;
+    uint32_t pending_min = 0;
+    uint32_t pending_size = 0;
+    uint32_t policies;
+    uint32_t max_list;
+    uint32_t max_fields;
+    uint32_t max_field;
+    int      encode;
+    int      options;
+    char     name[H2INTERN_MAXLEN + 1];
+    h2_buffer_t sbuf = {(char *)src, slen, slen};
+
+    if (slen < 15 || src[0] != H2SER_MAGIC || src[1] != H2SER_VERSION)
+        return NULL;
+    encode = src[2];
+    options = encode ? (uint8_t)src[3] : (uint8_t)src[4];
+    sbuf.pos = 7;
+    if (h2_hpack_getInt(&sbuf, &declare_size, 8, NULL) < 0 ||
+        h2_hpack_getInt(&sbuf, &current_size, 8, NULL) < 0 ||
+        h2_hpack_getInt(&sbuf, &max_entry_size, 8, NULL) < 0 ||
+        h2_hpack_getInt(&sbuf, &entries, 8, NULL) < 0) {
+        return NULL;
+    }
+    if (src[6]) {
+        if (h2_hpack_getInt(&sbuf, &pending_min, 8, NULL) < 0 ||
+            h2_hpack_getInt(&sbuf, &pending_size, 8, NULL) < 0) {
+            return NULL;
+        }
+    }
+    if (current_size > declare_size || pending_size > declare_size || pending_min > pending_size)
+        return NULL;
+
+    h2ctx = hpack_newContext(declare_size, encode, max_entry_size, options, (uint8_t)src[5]);
+    if (!h2ctx)
+        return NULL;
+    h2ctx->encode_opt = (uint8_t)src[3];
+    h2ctx->full_opt = h2ctx->encode_opt;
+    h2ctx->decode_opt = (uint8_t)src[4];
+    hpack_selectEncoder(h2ctx);
+    h2ctx->current_size = current_size;
+    h2ctx->app_size = current_size;
+    h2ctx->pending_update = !!src[6];
+    h2ctx->pending_min = pending_min;
+    h2ctx->pending_size = pending_size;
+
+    if (h2_hpack_getInt(&sbuf, &policies, 8, NULL) < 0 || (policies && !encode)) {
+        hpack_freeContext(h2ctx);
+        return NULL;
+    }
+    while (policies) {
+        if (h2_hpack_getInt(&sbuf, &hdrlen, 8, NULL) < 0 || hdrlen > H2INTERN_MAXLEN ||
+            hdrlen + 1 > (uint32_t)(sbuf.used - sbuf.pos))
+            break;
+        memcpy(name, sbuf.buf + sbuf.pos, hdrlen);
+        name[hdrlen] = 0;
+        sbuf.pos += hdrlen;
+        if (hdrlen != strlen(name) || hpack_setPolicy(h2ctx, name, (uint8_t)sbuf.buf[sbuf.pos++]))
+            break;
+        policies--;
+    }
+    if (policies ||
+        h2_hpack_getInt(&sbuf, &max_list, 8, NULL) < 0 ||
+        h2_hpack_getInt(&sbuf, &max_fields, 8, NULL) < 0 ||
+        h2_hpack_getInt(&sbuf, &max_field, 8, NULL) < 0 ||
+        ((max_list || max_fields || max_field) &&
+         hpack_setDecodeLimits(h2ctx, (int)max_list, (int)max_fields, (int)max_field))) {
+        hpack_freeContext(h2ctx);
+        return NULL;
+    }
+
+    while (entries--) {
+        const char * hdr;
+        if (h2_hpack_getInt(&sbuf, &hdrlen, 8, NULL) < 0 || hdrlen > (uint32_t)(sbuf.used - sbuf.pos))
+            break;
+        hdr = sbuf.buf + sbuf.pos;
+        sbuf.pos += hdrlen;
+        if (h2_hpack_getInt(&sbuf, &vallen, 8, NULL) < 0 || vallen > (uint32_t)(sbuf.used - sbuf.pos))
+            break;
+        /* The lengths must fit the entry, and an encoder never adds an entry larger than its maximum */
+        if (hdrlen > 0xffff || vallen > 0xffff || (encode && 32 + hdrlen + vallen > max_entry_size))
+            break;
+        if (32 + hdrlen + vallen > current_size - h2ctx->used_size || 32 + hdrlen + vallen > h2ctx->alloc_size)
+            break;
+        hpack_insertDynamic(h2ctx, hdr, hdrlen, sbuf.buf + sbuf.pos, vallen);
+        sbuf.pos += vallen;
+    }
+    if (entries != (uint32_t)-1 || sbuf.pos != sbuf.used) {
+        hpack_freeContext(h2ctx);
+        return NULL;
+    }
+    return h2ctx;
+}
+
+
 /*
  * Reduce the size of the dynmic table so enough space is available
  */
@@ -219,6 +727,8 @@ int hpack_reduceDynamic(h2_context_t * h2ctx, int size) {
         int entsize;
         ent = h2ctx->tail;
         entsize = 32 + ent->hdrlen + ent->valuelen;
+        if (ent->nametype == H2NAME_SHARED)
+            hpack_releaseName(hpack_entryShared(ent));
         if (ent->prev == NULL) {
             /* Unlink the last entry */
             h2ctx->head = NULL;
@@ -246,20 +756,400 @@ int hpack_changeDynamic(h2_context_t * h2ctx, int size) {
     }
 
     h2ctx->current_size = size;
-    if (size == 0) {
-        h2ctx->head = NULL;
-        h2ctx->tail = NULL;
-        h2ctx->entries = 0;
-        h2ctx->used_size = 0;
+    if (h2ctx->used_size > size) {
+        hpack_reduceDynamic(h2ctx, 0);
+    }
+    return 0;
+}
+
+
+/*
+ * Change the current size of the encoder dynamic table.
+ *
+ * The table is changed immediately and the size update is sent at the start of
+ * the next header block.  If the size is reduced and then increased again between
+ * header blocks, the smallest size is sent first so that the decoder evicts the
+ * same entries as the encoder.
+ */
+int hpack_setTableSize(h2_context_t * h2ctx, int size) {
+    int rc;
+
+    if (!h2ctx->encode)
+        return -1;
+    hpack_claimTable(h2ctx);
+    rc = hpack_tableSize(h2ctx, size);
+    if (rc == 0)
+        h2ctx->app_size = size;
+    hpack_releaseTable(h2ctx);
+    return rc;
+}
+
+static int hpack_tableSize(h2_context_t * h2ctx, int size) {
+    if (hpack_changeDynamic(h2ctx, size) < 0)
+        return -1;
+    if (!h2ctx->pending_update || size < (int)h2ctx->pending_min)
+        h2ctx->pending_min = size;
+    h2ctx->pending_size = size;
+    h2ctx->pending_update = 1;
+    return 0;
+}
+
+
+/*
+ * Take ownership of an encoder table for the calling thread.
+ * The governor only owns the table while it resizes it under the governor lock, so
+ * rather than spin while the table is copied this waits for the lock.
+ */
+static void hpack_claimTable(h2_context_t * h2ctx) {
+    while (!h2_atomic_cas32(&h2ctx->gov_owner, H2OWNER_NONE, H2OWNER_ENCODE)) {
+        h2_lock(&h2_gov.lock);
+        h2_unlock(&h2_gov.lock);
+    }
+}
+
+static void hpack_releaseTable(h2_context_t * h2ctx) {
+    h2_store_release(&h2ctx->gov_owner, H2OWNER_NONE);
+}
+
+
+/*
+ * Set the limits for decoding a header block
+ */
+int hpack_setDecodeLimits(h2_context_t * h2ctx, int maxlist, int maxfields, int maxfield) {
+    if (h2ctx->encode || maxlist < 0 || maxfields < 0 || maxfield < 0)
+        return -1;
+    h2ctx->max_list = maxlist;
+    h2ctx->max_fields = maxfields;
+    h2ctx->max_field = maxfield;
+    h2ctx->limits = maxlist || maxfields || maxfield;
+    return 0;
+}
+
+
+/*
+ * Check the size of a field against the decode limits
+ */
+static int hpack_limitSize(h2_context_t * h2ctx, const h2_use_t * use, uint64_t size) {
+    if (h2ctx->max_field && size > h2ctx->max_field)
+        return H2ERR_FIELDSIZE;
+    if (h2ctx->max_list && use->list + size + 32 > h2ctx->max_list)
+        return H2ERR_LISTSIZE;
+    return 0;
+}
+
+
+/*
+ * Check a field against the decode limits and add it to the use of the block
+ */
+static int hpack_limitField(h2_context_t * h2ctx, h2_use_t * use, uint64_t size) {
+    int rc;
+    if (h2ctx->max_fields && use->fields >= h2ctx->max_fields)
+        return H2ERR_FIELDCOUNT;
+    rc = hpack_limitSize(h2ctx, use, size);
+    if (rc < 0)
+        return rc;
+    use->fields++;
+    use->list += size + 32;
+    return 0;
+}
+
+
+/*
+ * Check an indexed field against the decode limits before it is copied.
+ * An index which is not in a table is left to be found by the decode.
+ */
+static int hpack_limitIndex(h2_context_t * h2ctx, h2_use_t * use, uint32_t index) {
+    h2_entry_t * ent;
+    if (index >= 62) {
+        ent = hpack_getEntry(h2ctx, index);
+        return ent ? hpack_limitField(h2ctx, use, ent->hdrlen + ent->valuelen) : 0;
+    }
+    if (!index)
+        return 0;
+    return hpack_limitField(h2ctx, use, h2s_namelen[index] + (index < 17 ? h2s_vallen[index] : 0));
+}
+
+
+/*
+ * Check a literal field against the decode limits before its strings are decoded.
+ * A huffman code is at most 30 bits, so a huffman string decodes to at least 8/30 of
+ * a byte for each byte.  The source is not moved.
+ */
+static int hpack_limitLiteral(h2_context_t * h2ctx, const h2_use_t * use, const h2_buffer_t * sbuf,
+        uint32_t index) {
+    h2_buffer_t pbuf = *sbuf;
+    h2_entry_t * ent;
+    const char * str;
+    uint64_t size = 0;
+    int  huff;
+    int  len;
+
+    if (h2ctx->max_fields && use->fields >= h2ctx->max_fields)
+        return H2ERR_FIELDCOUNT;
+    if (index >= 62) {
+        ent = hpack_getEntry(h2ctx, index);
+        size = ent ? ent->hdrlen : 0;
+    } else if (index) {
+        size = h2s_namelen[index];
     } else {
-        if (h2ctx->used_size > size) {
-            hpack_reduceDynamic(h2ctx, 0);
-        }
+        len = hpack_getLiteral(&pbuf, &str, &huff);
+        if (len < 0)
+            return len;
+        size = huff ? len*8/30 : len;
+    }
+    len = hpack_getLiteral(&pbuf, &str, &huff);
+    if (len < 0)
+        return len;
+    size += huff ? len*8/30 : len;
+    return hpack_limitSize(h2ctx, use, size);
+}
+
+
+/*
+ * Put any pending dynamic table size updates at the start of a header block
+ */
+static void hpack_putSizeUpdate(h2_context_t * h2ctx, h2_buffer_t * buf) {
+    if (h2ctx->pending_min < h2ctx->pending_size)
+        h2_hpack_putInt(buf, h2ctx->pending_min, 5, 0x20);
+    h2_hpack_putInt(buf, h2ctx->pending_size, 5, 0x20);
+    h2ctx->pending_update = 0;
+}
+
+
+/*
+ * Move the dynamic table to a new allocation of the given size.
+ * The entries are copied from oldest to newest so the new table is compact.
+ * The allocation must be at least the current size plus the max entry size.
+ * @return 0=good, H2ERR_ENTRYSIZE if the allocation is too small, or H2ERR_ALLOC
+ */
+int hpack_resizeTable(h2_context_t * h2ctx, int alloc) {
+    char *       oldtab = h2ctx->dyntab;
+    h2_entry_t * ent = h2ctx->tail;
+    char *       newtab = NULL;
+    int          where = 0;
+
+    if (alloc < (int)(h2ctx->current_size + h2ctx->max_entry_size))
+        return H2ERR_ENTRYSIZE;
+    if (alloc) {
+        newtab = malloc(alloc);
+        if (!newtab)
+            return H2ERR_ALLOC;
+    }
+    h2ctx->dyntab = newtab;
+    h2ctx->alloc_size = alloc;
+    h2ctx->generation++;
+    h2ctx->head = NULL;
+    h2ctx->tail = NULL;
+    h2ctx->used_size = 0;
+    h2ctx->entries = 0;
+    while (ent) {
+        h2_entry_t * newent = (h2_entry_t *)(newtab + where);
+        int size = hpack_entrySize(ent);
+        memcpy(newent, ent, size);
+        hpack_linkEntry(h2ctx, newent, ent->hdrlen, ent->valuelen);
+        where = (where + size + 7) & ~7;
+        ent = ent->prev;
     }
+    if (oldtab)
+        free(oldtab);
     return 0;
 }
 
 
+/*
+ * Change the size of an encoder table for the governor.
+ * The caller holds the governor lock and owns the table.  The table is compacted
+ * to the new size and the size update is sent at the start of the next block.
+ */
+static void hpack_governorResize(h2_context_t * h2ctx, uint32_t target) {
+    uint32_t oldalloc = h2ctx->alloc_size;
+
+    h2ctx->gov_pending = 0;
+    if (hpack_tableSize(h2ctx, target) < 0)
+        return;
+    if (hpack_resizeTable(h2ctx, target + h2ctx->max_entry_size) == 0) {
+        h2_gov.used += h2ctx->alloc_size;
+        h2_gov.used -= oldalloc;
+    }
+}
+
+
+/*
+ * Apply a table size requested by the governor while the encoder was in use.
+ * This is called by the thread using the encoder at the start of a header block,
+ * so the size update is sent to the decoder in this block.
+ */
+static void hpack_governorApply(h2_context_t * h2ctx) {
+    h2_lock(&h2_gov.lock);
+    if (h2ctx->gov_pending)
+        hpack_governorResize(h2ctx, h2ctx->gov_target);
+    h2_unlock(&h2_gov.lock);
+}
+
+
+/*
+ * Set the size of an encoder table for the governor.
+ * The caller holds the governor lock.  A table which is not in use is changed
+ * immediately, otherwise the encoder is asked to change it at its next block.
+ */
+static void hpack_governorSet(h2_context_t * h2ctx, uint32_t target) {
+    if (h2_atomic_cas32(&h2ctx->gov_owner, H2OWNER_NONE, H2OWNER_GOVERNOR)) {
+        hpack_governorResize(h2ctx, target);
+        h2_store_release(&h2ctx->gov_owner, H2OWNER_NONE);
+    } else {
+        h2ctx->gov_target = target;
+        h2ctx->gov_pending = 1;
+    }
+}
+
+
+/*
+ * Set the process wide memory budget for dynamic tables.
+ */
+int hpack_setMemoryBudget(uint64_t budget) {
+    h2_lock(&h2_gov.lock);
+    h2_gov.budget = budget;
+    h2_unlock(&h2_gov.lock);
+    return hpack_governorCheck();
+}
+
+
+/*
+ * Get the memory used by dynamic tables
+ */
+void hpack_getMemoryUsage(h2_memory_t * usage) {
+    h2_context_t * h2ctx;
+
+    h2_lock(&h2_gov.lock);
+    usage->budget   = h2_gov.budget;
+    usage->used     = h2_gov.used;
+    usage->projected = h2_gov.used;
+    for (h2ctx = h2_gov.head; h2ctx; h2ctx = h2ctx->gov_next) {
+        if (h2ctx->gov_pending)
+            usage->projected = usage->projected + h2ctx->gov_target + h2ctx->max_entry_size - h2ctx->alloc_size;
+    }
+    usage->decoders = h2_gov.decoders;
+    usage->contexts = h2_gov.contexts;
+    usage->shrinks  = h2_gov.shrinks;
+    usage->grows    = h2_gov.grows;
+    h2_unlock(&h2_gov.lock);
+    usage->interned = h2_load_acquire(&h2_intern.count);
+}
+
+
+/*
+ * Compute the value of an encoder table since the last check.
+ * Contexts which have been idle the longest have the least value, and after that
+ * contexts with the lowest dynamic table hit rate.  The counters are updated by the
+ * encoding thread without locks, so they are only used as a hint.
+ */
+static uint32_t hpack_governorValue(h2_context_t * h2ctx) {
+    uint32_t blocks = h2ctx->blocks - h2ctx->gov_blocks;
+    uint32_t fields = h2ctx->fields - h2ctx->gov_fields;
+    uint32_t hits   = h2ctx->hits - h2ctx->gov_hits;
+
+    h2ctx->gov_blocks += blocks;
+    h2ctx->gov_fields += fields;
+    h2ctx->gov_hits += hits;
+    if (blocks == 0) {
+        if (h2ctx->gov_idle < 255)
+            h2ctx->gov_idle++;
+        return 255 - h2ctx->gov_idle;
+    }
+    h2ctx->gov_idle = 0;
+    return 256 + (fields ? (hits * 256) / fields : 0);
+}
+
+
+/*
+ * Get the table size an encoder will have once any governor request is applied
+ */
+static uint32_t hpack_governorSize(h2_context_t * h2ctx) {
+    return h2ctx->gov_pending ? h2ctx->gov_target : h2ctx->current_size;
+}
+
+
+/*
+ * Check the memory budget.
+ *
+ * When the budget is exceeded, encoder tables with the least value are halved
+ * (or dropped if they are idle) until the projected use is within the budget.
+ * When the use falls below three quarters of the budget, the reduced tables with
+ * the most value are allowed to grow back to the size set by the application.  Tables which
+ * are not in use are changed immediately, and others at their next block.
+ */
+int hpack_governorCheck(void) {
+    h2_context_t * h2ctx;
+    h2_context_t * best;
+    uint64_t projected;
+    uint64_t limit;
+    uint32_t size;
+    uint32_t grow;
+    int      requests = 0;
+
+    h2_lock(&h2_gov.lock);
+    projected = h2_gov.used;
+    for (h2ctx = h2_gov.head; h2ctx; h2ctx = h2ctx->gov_next) {
+        if (h2ctx->encode) {
+            h2ctx->gov_value = hpack_governorValue(h2ctx);
+            if (h2ctx->gov_pending)
+                projected = projected + h2ctx->gov_target + h2ctx->max_entry_size - h2ctx->alloc_size;
+        }
+    }
+
+    /* Shrink the tables with the least value */
+    while (h2_gov.budget && projected > h2_gov.budget) {
+        best = NULL;
+        for (h2ctx = h2_gov.head; h2ctx; h2ctx = h2ctx->gov_next) {
+            if (h2ctx->encode && hpack_governorSize(h2ctx) && h2ctx->gov_value != 0xffffffff &&
+                    (!best || h2ctx->gov_value < best->gov_value)) {
+                best = h2ctx;
+            }
+        }
+        if (!best)
+            break;
+        size = hpack_governorSize(best);
+        projected -= size;
+        size = best->gov_idle ? 0 : size / 2;
+        if (size < 256)
+            size = 0;
+        projected += size;
+        best->gov_reduced = 1;
+        hpack_governorSet(best, size);
+        best->gov_value = 0xffffffff;        /* Only pick each context once per check */
+        h2_gov.shrinks++;
+        requests++;
+    }
+
+    /* Grow the tables with the most value when there is room */
+    limit = h2_gov.budget - h2_gov.budget/4;
+    while (!h2_gov.budget || projected < limit) {
+        best = NULL;
+        for (h2ctx = h2_gov.head; h2ctx; h2ctx = h2ctx->gov_next) {
+            if (h2ctx->gov_reduced && !h2ctx->gov_idle && h2ctx->gov_value != 0xffffffff &&
+                    (!best || h2ctx->gov_value > best->gov_value)) {
+                best = h2ctx;
+            }
+        }
+        if (!best)
+            break;
+        size = hpack_governorSize(best);
+        grow = best->app_size > size ? best->app_size - size : 0;
+        if (h2_gov.budget && projected + grow > limit)
+            break;
+        projected += grow;
+        best->gov_reduced = 0;
+        if (grow)
+            hpack_governorSet(best, best->app_size);
+        best->gov_value = 0xffffffff;
+        h2_gov.grows++;
+        requests++;
+    }
+    h2_unlock(&h2_gov.lock);
+    return requests;
+}
+
+
 /*
  * Canonicalize the http/2 headers
  * 1. Remove all optional white space
@@ -344,152 +1234,3048 @@ int hpack_canonicalize(char * buf, int len) {
  */
 int hpack_encode(h2_context_t * h2ctx, char * src, int slen, h2_buffer_t * buf) {
     int  rc;
-    char * hdr;
-    char * next;
-    char * value;
-    int    inx;
-    int    inx2;
-    int    idx;
 
     rc = hpack_canonicalize(src, slen);
     if (rc < 0)
         return rc;
+    hpack_timeStart(h2ctx);
+    hpack_startBlock(h2ctx, buf);
+    rc = hpack_encodeLines(h2ctx, src, rc, buf);
+    hpack_endBlock(h2ctx);
+    return rc;
+}
 
-    slen = rc;
-    hdr = src;
-    next = strchr(hdr, '\n');
-    if (next)
-        *next = 0;
-    while (*hdr) {
-        value = strchr(hdr+1, ':');
-        if (!value)
-            return -6;
-        *value++ = 0;
-        inx = 0;
-        inx2 = 0;
-        if (h2ctx->encode_opt >= H2ENCODE_STATIC) {
-            inx = hpack_lookupStatic(hdr, value);
-        }
-        if ((!inx || !(inx&NOLITERAL)) && (h2ctx->encode_opt >= H2ENCODE_MIN)) {
-            inx2 = hpack_lookupDynamic(h2ctx, hdr, value);
-            if (!inx || (inx2&NOLITERAL)) {
-                inx = inx2;
-            }
-        }
-        if (inx & NOLITERAL) {
-            h2_hpack_putInt(buf, inx&0xffffff, 7, 0x80);   /* indexed field */
-            //printf("enocde %s=%d\n", hdr, inx&0xffffff);
+
+/*
+ * Get the largest encoding of canonical header lines.
+ * A field is at most one byte for the representation and the name and value as strings,
+ * each with up to 5 bytes of length and 4 bytes for each character, as the longest
+ * huffman code is 30 bits.  With the colon and new line in each line this is less than
+ * 5 bytes for each character, and the constant covers a last line without a new line
+ * and two table size updates at the start of the block.
+ */
+int hpack_encodeBound(int len) {
+    if (len < 0 || len > (0x7fffffff - 24) / 5)
+        return -1;
+    return 5*len + 24;
+}
+
+
+/*
+ * Encode the fields in canonical header lines.
+ * If the buffer has room for the largest encoding the fields are encoded without
+ * checking the capacity for each one.  A buffer in the heap is grown once to make
+ * room, but a buffer supplied by the caller is only moved to the heap when needed.
+ */
+static int hpack_encodeLines(h2_context_t * h2ctx, char * src, int len, h2_buffer_t * buf) {
+    h2_encodeField_f encode = h2ctx->encodeField;
+    char * hdr;
+    char * next;
+    char * value;
+    int    bound;
+
+    bound = hpack_encodeBound(len);
+    if (bound >= 0) {
+        if (buf->inheap && buf->len - buf->used < bound)
+            h2_buffer_ensure(buf, bound);
+        if (buf->len - buf->used >= bound)
+            encode = h2ctx->encodeFast;
+    }
+
+    hdr = src;
+    next = strchr(hdr, '\n');
+    if (next)
+        *next = 0;
+    while (*hdr) {
+        value = strchr(hdr+1, ':');
+        if (!value)
+            return -6;
+        *value++ = 0;
+        encode(h2ctx, hdr, (int)(value - hdr - 1), value, (int)strlen(value), buf);
+        if (!next)
+            break;                        /* The last line has no new line */
+
+        hdr = next+1;
+        next = strchr(hdr, '\n');
+        if (next)
+            *next = 0;
+    }
+    return 0;
+}
+
+
+/*
+ * Encode decoded header fields, using the huffman encoded values where they are kept
+ */
+int hpack_encodeFields(h2_context_t * h2ctx, const char * base, const h2_field_t * fields, int count,
+        h2_buffer_t * buf) {
+    int i;
+
+    if (!h2ctx->encode || count < 0)
+        return -1;
+    hpack_timeStart(h2ctx);
+    hpack_startBlock(h2ctx, buf);
+    for (i=0; i<count; i++) {
+        h2ctx->rawval = base + fields[i].raw;
+        h2ctx->rawlen = fields[i].rawlen;
+        h2ctx->encodeField(h2ctx, base + fields[i].name, fields[i].namelen, base + fields[i].value,
+                fields[i].vallen, buf);
+    }
+    h2ctx->rawlen = 0;
+    hpack_endBlock(h2ctx);
+    return 0;
+}
+
+
+/*
+ * Start encoding a header block.
+ * The table is owned by this thread until hpack_endBlock.  Any table size change
+ * requested by the governor is applied and a pending dynamic table size update is
+ * written.
+ */
+static void hpack_startBlock(h2_context_t * h2ctx, h2_buffer_t * buf) {
+    hpack_claimTable(h2ctx);
+    if (h2ctx->gov_pending)
+        hpack_governorApply(h2ctx);
+    if (h2ctx->pending_update)
+        hpack_putSizeUpdate(h2ctx, buf);
+    if (h2ctx->memo_policy != h2_policy_gen) {
+        hpack_clearMemo(h2ctx);
+        h2ctx->memo_policy = h2_policy_gen;
+    }
+    if (h2ctx->load_level != h2_adapt.level)
+        hpack_loadApply(h2ctx);
+    h2ctx->blocks++;
+}
+
+
+/*
+ * End encoding a header block
+ */
+static void hpack_endBlock(h2_context_t * h2ctx) {
+    hpack_releaseTable(h2ctx);
+    hpack_timeEnd(h2ctx);
+}
+
+
+/*
+ * Set the encoder options for the current load level and select the encoder variant.
+ * The dynamic table is not changed, so the peer's table is still the same.  The memo
+ * is cleared so fields are encoded with the new options.
+ */
+static void hpack_loadApply(h2_context_t * h2ctx) {
+    uint32_t level = h2_adapt.level;
+    h2ctx->usehuff = level >= H2LOAD_NOHUFF ? 0 : h2ctx->full_huff;
+    h2ctx->encode_opt = h2ctx->full_opt;
+    if (level >= H2LOAD_STATIC && h2ctx->encode_opt > H2ENCODE_STATIC)
+        h2ctx->encode_opt = H2ENCODE_STATIC;
+    h2ctx->load_level = (uint8_t)level;
+    h2ctx->policy_serial++;
+    hpack_selectEncoder(h2ctx);
+    hpack_clearMemo(h2ctx);
+}
+
+
+/*
+ * Start and end the measurement of an encode call.
+ * The start is taken once the arguments are checked, and every return after it
+ * goes through hpack_endBlock, so an error never leaves a stale start time.
+ */
+static void hpack_timeStart(h2_context_t * h2ctx) {
+    if (h2_adapt.timing)
+        h2ctx->load_start = h2_nanotime();
+}
+
+static void hpack_timeEnd(h2_context_t * h2ctx) {
+    if (h2ctx->load_start) {
+        h2_atomic_add64(&h2_adapt.encode_ns, h2_nanotime() - h2ctx->load_start);
+        h2ctx->load_start = 0;
+    }
+}
+
+
+/*
+ * Set the watermarks of the load controller
+ */
+void hpack_setLoadWatermarks(uint64_t high, uint64_t low) {
+    h2_lock(&h2_adapt.lock);
+    h2_adapt.high = high;
+    h2_adapt.low = low < high ? low : high;
+    h2_adapt.timing = high != 0;
+    if (!high && h2_adapt.level != H2LOAD_FULL) {
+        h2_adapt.level = H2LOAD_FULL;
+        h2_adapt.changes++;
+    }
+    h2_unlock(&h2_adapt.lock);
+}
+
+
+/*
+ * Check the load and move one level up or down
+ */
+int hpack_loadCheck(uint64_t load) {
+    int level;
+    h2_lock(&h2_adapt.lock);
+    level = h2_adapt.level;
+    if (h2_adapt.high) {
+        if (load > h2_adapt.high && level < H2LOAD_STATIC)
+            level++;
+        else if (load < h2_adapt.low && level > H2LOAD_FULL)
+            level--;
+        if (level != (int)h2_adapt.level) {
+            h2_adapt.level = level;
+            h2_adapt.changes++;
+        }
+    }
+    h2_unlock(&h2_adapt.lock);
+    return level;
+}
+
+
+/*
+ * Get the state of the load controller
+ */
+void hpack_getLoad(h2_load_t * load) {
+    h2_lock(&h2_adapt.lock);
+    load->high      = h2_adapt.high;
+    load->low       = h2_adapt.low;
+    load->encode_ns = h2_adapt.encode_ns;
+    load->level     = h2_adapt.level;
+    load->changes   = h2_adapt.changes;
+    h2_unlock(&h2_adapt.lock);
+}
+
+
+/*
+ * The encoded field memo.
+ *
+ * The encoder keeps the representation of recently encoded fields in a small table
+ * indexed by a hash of the name and value, so a field which is sent again is encoded
+ * without the table lookups or huffman encoding.  A field which was indexed in the
+ * dynamic table keeps its entry and the insert count when the entry was added, which
+ * gives the index while the entry is in the table and the entries have not been moved.
+ * A literal which is not added to the table keeps a copy of the name, value, and
+ * encoded bytes as these do not depend on the table.  Each hash has two slots, and the
+ * one used least recently is replaced.
+ */
+#define H2MEMO_SLOTS    64                /* A power of 2 */
+#define H2MEMO_MAXTEXT  4096              /* The largest literal kept */
+
+typedef struct h2_memo_t {
+    uint32_t hash;                        /* The hash of the name and value, 0=empty */
+    uint32_t seq;                         /* The insert count after the entry was added */
+    uint32_t generation;                  /* The table generation for the entry */
+    uint32_t vallen;
+    uint16_t namelen;
+    uint16_t replen;                      /* The length of the literal, 0=indexed entry */
+    uint8_t  observe;                     /* The name has no ID and is counted for interning */
+    uint8_t  resv[3];
+    uint32_t textlen;                     /* The allocated length of the text */
+    uint32_t stamp;                       /* The field count when last used */
+    h2_entry_t * ent;                     /* The indexed entry */
+    char *   text;                        /* The name, value, and encoded literal */
+} h2_memo_t;
+
+
+/*
+ * Enable or disable the memo for an encoder context
+ */
+int hpack_setMemo(h2_context_t * h2ctx, int enable) {
+    int i;
+    if (enable) {
+        if (!h2ctx->memo && h2ctx->encode)
+            h2ctx->memo = calloc(H2MEMO_SLOTS, sizeof(h2_memo_t));
+        return h2ctx->memo ? 0 : -1;
+    }
+    if (h2ctx->memo) {
+        for (i=0; i<H2MEMO_SLOTS; i++)
+            free(h2ctx->memo[i].text);
+        free(h2ctx->memo);
+        h2ctx->memo = NULL;
+    }
+    return 0;
+}
+
+
+/*
+ * Forget all memo fields
+ */
+static void hpack_clearMemo(h2_context_t * h2ctx) {
+    int i;
+    if (h2ctx->memo) {
+        for (i=0; i<H2MEMO_SLOTS; i++)
+            h2ctx->memo[i].hash = 0;
+    }
+}
+
+
+/*
+ * Hash a field for the memo.
+ * Only the start and end of a long value are used, as a match is always compared.
+ */
+static uint32_t hpack_memoHash(const char * hdr, int hdrlen, const char * value, int vallen) {
+    uint32_t hash = 2166136261U ^ (uint32_t)vallen;
+    int i;
+    for (i=0; i<hdrlen; i++)
+        hash = (hash ^ (uint8_t)hdr[i]) * 16777619;
+    if (vallen > 16) {
+        for (i=0; i<8; i++)
+            hash = (hash ^ (uint8_t)value[i]) * 16777619;
+        value += vallen - 8;
+        vallen = 8;
+    }
+    for (i=0; i<vallen; i++)
+        hash = (hash ^ (uint8_t)value[i]) * 16777619;
+    hash ^= hash >> 16;
+    return hash ? hash : 1;
+}
+
+
+/*
+ * Encode a field from the memo.
+ * A name without an ID is still counted for interning, as it would be if the field
+ * were encoded without the memo, until it has an ID.
+ * @return 1 if the field is encoded, 0 if it is not in the memo
+ */
+static int hpack_memoEncode(h2_context_t * h2ctx, h2_memo_t * memo, uint32_t hash, const char * hdr,
+        int hdrlen, const char * value, int vallen, h2_buffer_t * buf, int fast) {
+    h2_entry_t * ent;
+
+    if (memo->hash != hash || memo->namelen != hdrlen || memo->vallen != (uint32_t)vallen)
+        return 0;
+    if (memo->replen) {
+        if (memcmp(memo->text, hdr, hdrlen) || memcmp(memo->text + hdrlen, value, vallen))
+            return 0;
+        if (fast)
+            h2_buffer_putBytesFast(buf, memo->text + hdrlen + vallen, memo->replen);
+        else
+            h2_buffer_putBytes(buf, memo->text + hdrlen + vallen, memo->replen);
+        if (memo->observe && h2_intern.threshold && hpack_nameId(hdr, hdrlen, 1))
+            memo->observe = 0;
+        memo->stamp = h2ctx->fields++;
+        return 1;
+    }
+
+    /* The entry is still in the table if fewer than entries fields have been added since */
+    ent = memo->ent;
+    if (memo->generation != h2ctx->generation || h2ctx->inserts - memo->seq >= h2ctx->entries ||
+            memcmp(hpack_entryName(ent), hdr, hdrlen) || memcmp(hpack_entryValue(ent), value, vallen)) {
+        return 0;
+    }
+    if (fast)
+        h2_hpack_putIntFast(buf, 62 + h2ctx->inserts - memo->seq, 7, 0x80);
+    else
+        h2_hpack_putInt(buf, 62 + h2ctx->inserts - memo->seq, 7, 0x80);
+    if (memo->observe && h2_intern.threshold && hpack_nameId(hdr, hdrlen, 1))
+        memo->observe = 0;
+    memo->stamp = h2ctx->fields++;
+    h2ctx->hits++;
+    return 1;
+}
+
+
+/*
+ * Keep a field which was indexed in the dynamic table in the memo
+ */
+static void hpack_memoIndexed(h2_context_t * h2ctx, h2_memo_t * memo, uint32_t hash, int hdrlen,
+        int vallen, h2_entry_t * ent, int inx, int observe) {
+    memo->hash = hash;
+    memo->observe = (uint8_t)observe;
+    memo->namelen = (uint16_t)hdrlen;
+    memo->vallen = vallen;
+    memo->replen = 0;
+    memo->ent = ent;
+    memo->seq = h2ctx->inserts - (inx - 62);
+    memo->generation = h2ctx->generation;
+    memo->stamp = h2ctx->fields;
+}
+
+
+/*
+ * Keep a literal field in the memo
+ */
+static void hpack_memoLiteral(h2_context_t * h2ctx, h2_memo_t * memo, uint32_t hash, const char * hdr,
+        int hdrlen, const char * value, int vallen, const char * rep, int replen, int observe) {
+    uint32_t need = hdrlen + vallen + replen;
+    if (need > H2MEMO_MAXTEXT || replen > 0xffff)
+        return;
+    if (need > memo->textlen) {
+        char * text = realloc(memo->text, need);
+        if (!text)
+            return;
+        memo->text = text;
+        memo->textlen = need;
+    }
+    memcpy(memo->text, hdr, hdrlen);
+    memcpy(memo->text + hdrlen, value, vallen);
+    memcpy(memo->text + hdrlen + vallen, rep, replen);
+    memo->hash = hash;
+    memo->namelen = (uint16_t)hdrlen;
+    memo->vallen = vallen;
+    memo->replen = (uint16_t)replen;
+    memo->observe = (uint8_t)observe;
+    memo->stamp = h2ctx->fields;
+}
+
+
+/*
+ * Put a string with a constant huffman option
+ */
+#define H2PUTSTRING(buf, str, len, huff, fast) \
+    ((fast) ? ((huff) ? h2_hpack_putHufStringFast(buf, str, len) : (h2_hpack_putRawStringFast(buf, str, len), 0)) : \
+              ((huff) ? h2_hpack_putHufString(buf, str, len) : h2_hpack_putRawString(buf, str, len)))
+
+/*
+ * Put a byte, bytes or an integer with a constant option to check the buffer capacity
+ */
+#define H2PUTBYTE(buf, ch, fast) \
+    if (!(fast) && (buf)->used >= (buf)->len) \
+        h2_buffer_ensure((buf), 1); \
+    (buf)->buf[(buf)->used++] = (char)(ch);
+#define H2PUTBYTES(buf, bytes, len, fast) \
+    ((fast) ? (void)h2_buffer_putBytesFast(buf, bytes, len) : h2_buffer_putBytes(buf, bytes, len))
+#define H2PUTINT(buf, value, bits, upper, fast) \
+    ((fast) ? h2_hpack_putIntFast(buf, value, bits, upper) : (void)h2_hpack_putInt(buf, value, bits, upper))
+
+
+/*
+ * Encode one header field with the encoder options as arguments.
+ *
+ * This is inlined with constant options into a function for each combination of the
+ * options, so the variant selected for a context does not test them for each field.
+ * The fast variants do not check the buffer capacity, and are only used when the
+ * buffer has room for hpack_encodeBound() bytes.
+ * The indexing policy of the name decides whether the dynamic table is used.  A name
+ * with H2POLICY_NEVER is sent as a literal never indexed, using a table index only for
+ * the name.
+ */
+static XFORCEINLINE void hpack_encodeFieldOpt(h2_context_t * h2ctx, const char * hdr, int hdrlen,
+        const char * value, int vallen, h2_buffer_t * buf, const int opt, const int huff, const int fast) {
+    int    inx;
+    int    inx2;
+    int    idx;
+    int    id;
+    int    policy;
+    h2_entry_t * nament;
+    h2_newname_t nn;
+    h2_memo_t * memo = NULL;
+    uint32_t hash = 0;
+    int    start;
+
+    if (h2ctx->memo) {
+        hash = hpack_memoHash(hdr, hdrlen, value, vallen);
+        memo = h2ctx->memo + (hash & (H2MEMO_SLOTS-2));
+        if (hpack_memoEncode(h2ctx, memo, hash, hdr, hdrlen, value, vallen, buf, fast) ||
+                hpack_memoEncode(h2ctx, memo+1, hash, hdr, hdrlen, value, vallen, buf, fast)) {
+            return;
+        }
+        if (memo[1].stamp < memo[0].stamp)
+            memo++;
+    }
+    start = buf->used;
+    inx = 0;
+    inx2 = 0;
+    nament = NULL;
+    if (opt >= H2ENCODE_STATIC)
+        inx = hpack_lookupStaticLen(hdr, hdrlen, value, vallen);
+    if (inx)
+        id = h2s_first[inx & 0xff];
+    else
+        id = hpack_nameId(hdr, hdrlen, opt >= H2ENCODE_MIN);
+    policy = h2ctx->policy[id];
+    if ((!inx || !(inx&NOLITERAL)) && opt >= H2ENCODE_MIN && policy != H2POLICY_STATIC) {
+        inx2 = hpack_findDynamic(h2ctx, hdr, hdrlen, value, vallen, id, &nament);
+        if (!inx || (inx2&NOLITERAL)) {
+            inx = inx2;
+        }
+        if (inx2)
+            h2ctx->hits++;
+    }
+    if (policy == H2POLICY_NEVER)
+        inx &= ~NOLITERAL;
+    h2ctx->fields++;
+    if (inx & NOLITERAL) {
+        H2PUTINT(buf, inx&0xffffff, 7, 0x80, fast);    /* indexed field */
+        //printf("enocde %s=%d\n", hdr, inx&0xffffff);
+        if (memo && (inx&0xffffff) >= 62)
+            hpack_memoIndexed(h2ctx, memo, hash, hdrlen, vallen, hpack_getEntry(h2ctx, inx&0xffffff), inx&0xffffff,
+                    !id && opt >= H2ENCODE_MIN);
+    } else {
+        idx = 0;
+        if (policy == H2POLICY_INDEX) {
+            hpack_resolveName(&nn, hdr, hdrlen, id, nament);
+            idx = hpack_pushEntryOpt(h2ctx, &nn, value, vallen, opt);
+        }
+        if (idx) {
+            if (inx == 0) {
+                H2PUTBYTE(buf, 0x40, fast);
+                H2PUTSTRING(buf, hdr, hdrlen, huff, fast);
+                //printf("encode add0 %s: %s\n", hdr, value);
+            } else {
+                H2PUTINT(buf, inx, 6, 0x40, fast);
+                //printf("encode addx %s=%d: %s\n", hdr, inx, value);
+            }
+        } else {
+            int flags = policy == H2POLICY_NEVER ? 0x10 : 0x00;
+            if (inx == 0) {
+                H2PUTBYTE(buf, flags, fast);
+                H2PUTSTRING(buf, hdr, hdrlen, huff, fast);
+                //printf("encode 0 %s: %s\n", hdr, value);
+            } else {
+                H2PUTINT(buf, inx, 4, flags, fast);
+                //printf("encode x %s=%d: %s\n", hdr, inx, value);
+            }
+        }
+        if (huff && h2ctx->rawlen) {
+            H2PUTINT(buf, h2ctx->rawlen, 7, 0x80, fast);
+            H2PUTBYTES(buf, h2ctx->rawval, h2ctx->rawlen, fast);
+        } else {
+            H2PUTSTRING(buf, value, vallen, huff, fast);
+        }
+        if (memo) {
+            if (idx)
+                hpack_memoIndexed(h2ctx, memo, hash, hdrlen, vallen, h2ctx->head, 62, !id && opt >= H2ENCODE_MIN);
+            else if (inx < 62 && (policy != H2POLICY_INDEX || opt < H2ENCODE_MIN))
+                hpack_memoLiteral(h2ctx, memo, hash, hdr, hdrlen, value, vallen, buf->buf + start, buf->used - start,
+                        !id && opt >= H2ENCODE_MIN);
+        }
+    }
+}
+
+
+/*
+ * The encoder variants for each encoder option, huffman setting and capacity check
+ */
+#define H2ENCODE_VARIANT(opt, huff, fast) \
+static void hpack_encodeField_##opt##_##huff##_##fast(h2_context_t * h2ctx, const char * hdr, int hdrlen, \
+        const char * value, int vallen, h2_buffer_t * buf) { \
+    hpack_encodeFieldOpt(h2ctx, hdr, hdrlen, value, vallen, buf, opt, huff, fast); \
+}
+H2ENCODE_VARIANT(0, 0, 0)
+H2ENCODE_VARIANT(0, 0, 1)
+H2ENCODE_VARIANT(0, 1, 0)
+H2ENCODE_VARIANT(0, 1, 1)
+H2ENCODE_VARIANT(1, 0, 0)
+H2ENCODE_VARIANT(1, 0, 1)
+H2ENCODE_VARIANT(1, 1, 0)
+H2ENCODE_VARIANT(1, 1, 1)
+H2ENCODE_VARIANT(2, 0, 0)
+H2ENCODE_VARIANT(2, 0, 1)
+H2ENCODE_VARIANT(2, 1, 0)
+H2ENCODE_VARIANT(2, 1, 1)
+H2ENCODE_VARIANT(3, 0, 0)
+H2ENCODE_VARIANT(3, 0, 1)
+H2ENCODE_VARIANT(3, 1, 0)
+H2ENCODE_VARIANT(3, 1, 1)
+
+static const h2_encodeField_f h2_encodeVariants[4][2][2] = {
+    { { hpack_encodeField_0_0_0, hpack_encodeField_0_0_1 }, { hpack_encodeField_0_1_0, hpack_encodeField_0_1_1 } },
+    { { hpack_encodeField_1_0_0, hpack_encodeField_1_0_1 }, { hpack_encodeField_1_1_0, hpack_encodeField_1_1_1 } },
+    { { hpack_encodeField_2_0_0, hpack_encodeField_2_0_1 }, { hpack_encodeField_2_1_0, hpack_encodeField_2_1_1 } },
+    { { hpack_encodeField_3_0_0, hpack_encodeField_3_0_1 }, { hpack_encodeField_3_1_0, hpack_encodeField_3_1_1 } },
+};
+
+
+/*
+ * Encode one header field testing the options and profile for each field.
+ * This is used when the encoder variants are not selected.
+ */
+static void hpack_encodeField(h2_context_t * h2ctx, const char * hdr, int hdrlen, const char * value,
+        int vallen, h2_buffer_t * buf) {
+    if (h2ctx->grpc && hpack_grpcField(h2ctx, hdr, hdrlen, value, vallen, buf))
+        return;
+    hpack_encodeFieldOpt(h2ctx, hdr, hdrlen, value, vallen, buf, h2ctx->encode_opt, h2ctx->usehuff, 0);
+}
+
+
+/*
+ * Encode one header field using the gRPC profile and then the encoder variant
+ */
+static void hpack_encodeGrpcField(h2_context_t * h2ctx, const char * hdr, int hdrlen, const char * value,
+        int vallen, h2_buffer_t * buf) {
+    if (!hpack_grpcField(h2ctx, hdr, hdrlen, value, vallen, buf))
+        h2ctx->encodeVariant(h2ctx, hdr, hdrlen, value, vallen, buf);
+}
+
+
+/*
+ * Select the encoder variant for the options of a context
+ */
+static void hpack_selectEncoder(h2_context_t * h2ctx) {
+    int opt = h2ctx->encode_opt > H2ENCODE_MAX ? H2ENCODE_MAX : h2ctx->encode_opt;
+    h2ctx->encodeVariant = h2_encodeVariants[opt][!!h2ctx->usehuff][0];
+    h2ctx->encodeField = h2ctx->grpc ? hpack_encodeGrpcField : h2ctx->encodeVariant;
+    h2ctx->encodeFast = h2ctx->grpc ? hpack_encodeGrpcField : h2_encodeVariants[opt][!!h2ctx->usehuff][1];
+}
+
+
+/*
+ * Select the specialized encoder variants or the generic encoder for a context
+ */
+void hpack_setEncodeVariant(h2_context_t * h2ctx, int specialized) {
+    if (specialized)
+        hpack_selectEncoder(h2ctx);
+    else
+        h2ctx->encodeField = h2ctx->encodeFast = hpack_encodeField;
+}
+
+
+/*
+ * Set the default indexing policy.
+ * This is called when the first context is created.
+ */
+static void hpack_initPolicy(void) {
+    int i;
+    int id;
+    for (i=0; h2_policy_names[i].name; i++) {
+        id = hpack_internName(h2_policy_names[i].name, (int)strlen(h2_policy_names[i].name));
+        if (id)
+            h2_policy_default[id] = h2_policy_names[i].policy;
+    }
+    h2_policy_init = 1;
+}
+
+
+/*
+ * Set the indexing policy for a header name
+ */
+int hpack_setPolicy(h2_context_t * h2ctx, const char * name, int policy) {
+    uint8_t * ptab;
+    int id;
+
+    if (policy < H2POLICY_INDEX || policy > H2POLICY_STATIC)
+        return -1;
+    if (!h2_policy_init)
+        hpack_initPolicy();
+    id = hpack_internName(name, (int)strlen(name));
+    if (!id)
+        return -1;
+    if (!h2ctx) {
+        h2_policy_default[id] = (uint8_t)policy;
+        h2_policy_gen++;
+        return 0;
+    }
+    if (!h2ctx->encode)
+        return -1;
+    ptab = h2ctx->policy;
+    if (ptab == h2_policy_default) {
+        ptab = malloc(sizeof h2_policy_default);
+        if (!ptab)
+            return H2ERR_ALLOC;
+        memcpy(ptab, h2_policy_default, sizeof h2_policy_default);
+        h2ctx->policy = ptab;
+    }
+    ptab[id] = (uint8_t)policy;
+    h2ctx->policy_serial++;
+    hpack_clearMemo(h2ctx);
+    return 0;
+}
+
+
+/*
+ * Get the indexing policy for a header name
+ */
+int hpack_getPolicy(h2_context_t * h2ctx, const char * name) {
+    uint8_t * ptab = h2ctx ? h2ctx->policy : h2_policy_default;
+    return ptab[hpack_getHeaderId(name, (int)strlen(name))];
+}
+
+
+/*
+ * The gRPC profile.
+ *
+ * The common gRPC header fields are encoded once when the context is created.  A field
+ * with a fixed value is encoded as a literal with incremental indexing and the number
+ * of inserts when it was added is kept, so while it is still in the dynamic table its
+ * index is known without a lookup.  The grpc-message value is rarely repeated, so
+ * only its name is encoded and it is sent as a literal without indexing.
+ */
+#define H2GRPC_STATUS0  2                 /* The grpc-status: 0 field */
+#define H2GRPC_FIELDS   6
+static const struct {
+    const char * name;
+    const char * value;                   /* The value, or NULL for a variable value */
+    uint8_t      namelen;
+    uint8_t      vallen;
+} h2_grpcfields[H2GRPC_FIELDS] = {
+    {"content-type",         "application/grpc",      12, 16},
+    {"te",                   "trailers",               2,  8},
+    {"grpc-status",          "0",                     11,  1},
+    {"grpc-encoding",        "identity",              13,  8},
+    {"grpc-accept-encoding", "identity,deflate,gzip", 20, 21},
+    {"grpc-message",         NULL,                    12,  0},
+};
+
+typedef struct h2_grpc_t {
+    uint32_t seq[H2GRPC_FIELDS];          /* The insert count after the field was added, 0=never */
+    uint16_t off[H2GRPC_FIELDS];          /* The offset of the encoded field */
+    uint16_t len[H2GRPC_FIELDS];          /* The length of the encoded field */
+    char     bytes[256];                  /* The encoded fields */
+} h2_grpc_t;
+
+
+/*
+ * Create a new hpack context with the gRPC profile
+ */
+h2_context_t * hpack_newGrpcContext(int size, int encode, int maxentry, int options, int huff) {
+    h2_context_t * h2ctx;
+    h2_grpc_t * grpc;
+    h2_buffer_t gbuf;
+    h2_buffer_t * buf = &gbuf;
+    int i;
+
+    h2ctx = hpack_newContext(size, encode, maxentry, options, huff);
+    if (!h2ctx)
+        return NULL;
+
+    /* The gRPC names are interned so they are shared and have header IDs */
+    for (i=0; i<H2GRPC_FIELDS; i++) {
+        if (h2_grpcfields[i].namelen >= H2NAME_MINSHARE && !hpack_lookupStaticLen(h2_grpcfields[i].name,
+                h2_grpcfields[i].namelen, "", 0)) {
+            hpack_internName(h2_grpcfields[i].name, h2_grpcfields[i].namelen);
+        }
+    }
+    if (!h2ctx->encode)
+        return h2ctx;
+
+    grpc = malloc(sizeof(h2_grpc_t));
+    if (!grpc) {
+        hpack_freeContext(h2ctx);
+        return NULL;
+    }
+    memset(grpc, 0, sizeof(h2_grpc_t));
+    memset(buf, 0, sizeof gbuf);
+    gbuf.buf = grpc->bytes;
+    gbuf.len = sizeof grpc->bytes;
+    for (i=0; i<H2GRPC_FIELDS; i++) {
+        int sinx = hpack_lookupStaticLen(h2_grpcfields[i].name, h2_grpcfields[i].namelen, "", 0);
+        int prefix = h2_grpcfields[i].value ? 6 : 4;
+        int flags = h2_grpcfields[i].value ? 0x40 : 0x00;
+        grpc->off[i] = (uint16_t)buf->used;
+        if (sinx) {
+            h2_hpack_putInt(buf, sinx, prefix, flags);
+        } else {
+            h2_buffer_put(buf, (char)flags);
+            h2_hpack_putString(buf, h2_grpcfields[i].name, h2_grpcfields[i].namelen, h2ctx->usehuff);
+        }
+        if (h2_grpcfields[i].value)
+            h2_hpack_putString(buf, h2_grpcfields[i].value, h2_grpcfields[i].vallen, h2ctx->usehuff);
+        grpc->len[i] = (uint16_t)(buf->used - grpc->off[i]);
+    }
+    h2ctx->grpc = grpc;
+    hpack_selectEncoder(h2ctx);
+    return h2ctx;
+}
+
+
+/*
+ * Encode a gRPC field with a fixed value.
+ * @return 1 if the field is encoded, 0 if it is not added to the dynamic table
+ */
+static int hpack_grpcFixed(h2_context_t * h2ctx, int which, h2_buffer_t * buf) {
+    h2_grpc_t * grpc = h2ctx->grpc;
+    h2_newname_t nn;
+
+    /* The field is still in the table if fewer than entries fields have been added since */
+    if (grpc->seq[which] && h2ctx->inserts - grpc->seq[which] < h2ctx->entries) {
+        h2_hpack_putInt(buf, 62 + h2ctx->inserts - grpc->seq[which], 7, 0x80);
+        h2ctx->fields++;
+        h2ctx->hits++;
+        return 1;
+    }
+    hpack_resolveName(&nn, h2_grpcfields[which].name, h2_grpcfields[which].namelen, -1, NULL);
+    if (!hpack_pushEntry(h2ctx, &nn, h2_grpcfields[which].value, h2_grpcfields[which].vallen))
+        return 0;
+    grpc->seq[which] = h2ctx->inserts;
+    h2_buffer_putBytes(buf, grpc->bytes + grpc->off[which], grpc->len[which]);
+    h2ctx->fields++;
+    return 1;
+}
+
+
+/*
+ * Encode a field using the gRPC profile.
+ * @return 1 if the field is encoded, 0 if it is not a gRPC field
+ */
+static int hpack_grpcField(h2_context_t * h2ctx, const char * hdr, int hdrlen, const char * value,
+        int vallen, h2_buffer_t * buf) {
+    h2_grpc_t * grpc = h2ctx->grpc;
+    int i;
+
+    for (i=0; i<H2GRPC_FIELDS; i++) {
+        if (h2_grpcfields[i].namelen == hdrlen && !memcmp(h2_grpcfields[i].name, hdr, hdrlen))
+            break;
+    }
+    if (i == H2GRPC_FIELDS)
+        return 0;
+    if (h2_grpcfields[i].value) {
+        if (vallen != h2_grpcfields[i].vallen || memcmp(h2_grpcfields[i].value, value, vallen))
+            return 0;
+        return hpack_grpcFixed(h2ctx, i, buf);
+    }
+    h2_buffer_putBytes(buf, grpc->bytes + grpc->off[i], grpc->len[i]);
+    h2_hpack_putString(buf, value, vallen, h2ctx->usehuff);
+    h2ctx->fields++;
+    return 1;
+}
+
+
+/*
+ * Encode a gRPC trailer
+ */
+int hpack_encodeGrpcStatus(h2_context_t * h2ctx, int status, const char * message, h2_buffer_t * buf) {
+    char value[16];
+    char * vp;
+
+    if (!h2ctx->encode || status < 0)
+        return -1;
+    hpack_timeStart(h2ctx);
+    hpack_startBlock(h2ctx, buf);
+    if (status != 0 || !h2ctx->grpc || !hpack_grpcFixed(h2ctx, H2GRPC_STATUS0, buf)) {
+        vp = value + sizeof value;
+        do {
+            *--vp = (char)('0' + status%10);
+            status /= 10;
+        } while (status);
+        h2ctx->encodeField(h2ctx, "grpc-status", 11, vp, (int)(value + sizeof value - vp), buf);
+    }
+    if (message && *message)
+        h2ctx->encodeField(h2ctx, "grpc-message", 12, message, (int)strlen(message), buf);
+    hpack_endBlock(h2ctx);
+    return 0;
+}
+
+
+/*
+ * Header templates.
+ *
+ * The fields of a template are encoded once when it is created.  A field which is
+ * fully in the static table, or which is not added to the dynamic table because of the
+ * encoder options or its indexing policy, always has the same encoding.  Other fields
+ * are encoded as a literal with incremental indexing, and as with the gRPC profile the
+ * number of inserts when the field was added gives its index while it is still in the
+ * dynamic table.  When the template is encoded without adding any entries, the output
+ * depends only on the number of inserts and entries in the table, so it is kept and
+ * copied the next time the table is in the same state.  The fields are encoded again
+ * when the options or indexing policies of the context change.
+ */
+#define H2TMPL_FIXED   0                  /* The encoding does not change */
+#define H2TMPL_INDEX   1                  /* Added to the dynamic table */
+
+typedef struct h2_tmplfield_t {
+    const char * name;
+    const char * value;
+    uint32_t seq;                         /* The insert count after the field was added, 0=never */
+    uint16_t namelen;
+    uint16_t vallen;
+    uint16_t off;                         /* The offset of the encoded field */
+    uint16_t len;                         /* The length of the encoded field */
+    uint8_t  kind;                        /* H2TMPL_FIXED or H2TMPL_INDEX */
+    uint8_t  resv[3];
+} h2_tmplfield_t;
+
+struct h2_template_t {
+    h2_context_t * h2ctx;                 /* The encoder context */
+    int      count;                       /* The number of fields */
+    char   * bytes;                       /* The encoded fields */
+    char   * block;                       /* The last encoded template */
+    int      blockmax;                    /* The allocated size of the block */
+    int      blocklen;                    /* The length of the block, 0=none */
+    uint32_t block_inserts;               /* The insert count when the block was encoded */
+    uint32_t block_entries;               /* The entry count when the block was encoded */
+    uint32_t block_hits;                  /* The number of dynamic table hits in the block */
+    uint32_t policy_gen;                  /* The global policy generation when encoded */
+    uint32_t policy_serial;               /* The context policy serial when encoded */
+    h2_tmplfield_t fields[1];
+};
+
+
+/*
+ * Create a header template
+ */
+h2_template_t * hpack_newTemplate(h2_context_t * h2ctx, const char * hdrs, int hdrlen) {
+    h2_template_t * tmpl;
+    h2_tmplfield_t * fld;
+    char * src;
+    char * text;
+    char * hdr;
+    char * next;
+    char * value;
+    int    count;
+    int    rc;
+
+    if (!h2ctx || !h2ctx->encode || !hdrs)
+        return NULL;
+    if (hdrlen < 0)
+        hdrlen = (int)strlen(hdrs);
+    src = malloc(hdrlen + 1);
+    if (!src)
+        return NULL;
+    memcpy(src, hdrs, hdrlen);
+    src[hdrlen] = 0;
+    rc = hpack_canonicalize(src, hdrlen);
+    if (rc < 0) {
+        free(src);
+        return NULL;
+    }
+    src[rc] = 0;
+    count = 0;
+    for (hdr = src; *hdr; hdr++) {
+        if (*hdr == '\n')
+            count++;
+    }
+    if (rc && src[rc-1] != '\n')
+        count++;
+
+    /* The fields, names and values are in one allocation */
+    tmpl = malloc(sizeof(h2_template_t) + count * sizeof(h2_tmplfield_t) + rc + 1);
+    if (!tmpl) {
+        free(src);
+        return NULL;
+    }
+    memset(tmpl, 0, sizeof(h2_template_t) + count * sizeof(h2_tmplfield_t));
+    tmpl->h2ctx = h2ctx;
+    text = (char *)(tmpl->fields + count + 1);
+    memcpy(text, src, rc + 1);
+    free(src);
+
+    hdr = text;
+    next = strchr(hdr, '\n');
+    if (next)
+        *next = 0;
+    while (*hdr) {
+        size_t vallen;
+        value = strchr(hdr+1, ':');
+        if (!value) {
+            free(tmpl);
+            return NULL;
+        }
+        *value++ = 0;
+        vallen = strlen(value);
+        if (value - hdr - 1 > 0xffff || vallen > 0xffff) {
+            free(tmpl);
+            return NULL;
+        }
+        fld = tmpl->fields + tmpl->count++;
+        fld->name = hdr;
+        fld->namelen = (uint16_t)(value - hdr - 1);
+        fld->value = value;
+        fld->vallen = (uint16_t)vallen;
+
+        /* The names of a template are expected to be used often */
+        if (fld->namelen >= H2NAME_MINSHARE && !hpack_lookupStaticLen(fld->name, fld->namelen, "", 0))
+            hpack_internName(fld->name, fld->namelen);
+
+        if (!next)
+            break;
+        hdr = next+1;
+        next = strchr(hdr, '\n');
+        if (next)
+            *next = 0;
+    }
+
+    if (hpack_templateCompile(h2ctx, tmpl) < 0) {
+        free(tmpl);
+        return NULL;
+    }
+    return tmpl;
+}
+
+
+/*
+ * Encode the fields of a template using the current options and indexing policies
+ */
+static int hpack_templateCompile(h2_context_t * h2ctx, h2_template_t * tmpl) {
+    h2_tmplfield_t * fld;
+    h2_buffer_t tbuf;
+    h2_buffer_t * buf = &tbuf;
+    char   tbytes[1024];
+    char * bytes;
+    int    sinx;
+    int    id;
+    int    policy;
+    int    i;
+
+    memset(buf, 0, sizeof tbuf);
+    tbuf.buf = tbytes;
+    tbuf.len = sizeof tbytes;
+    for (i=0; i<tmpl->count; i++) {
+        fld = tmpl->fields + i;
+        fld->off = (uint16_t)buf->used;
+        fld->kind = H2TMPL_FIXED;
+
+        sinx = h2ctx->encode_opt >= H2ENCODE_STATIC ?
+               hpack_lookupStaticLen(fld->name, fld->namelen, fld->value, fld->vallen) : 0;
+        if (sinx & NOLITERAL) {
+            h2_hpack_putInt(buf, sinx&0xffffff, 7, 0x80);
+        } else {
+            id = sinx ? h2s_first[sinx] : hpack_nameId(fld->name, fld->namelen, 0);
+            policy = h2ctx->policy[id];
+            if (policy == H2POLICY_INDEX && h2ctx->encode_opt >= H2ENCODE_MIN) {
+                fld->kind = H2TMPL_INDEX;
+                if (sinx) {
+                    h2_hpack_putInt(buf, sinx, 6, 0x40);
+                } else {
+                    h2_buffer_put(buf, 0x40);
+                    h2_hpack_putString(buf, fld->name, fld->namelen, h2ctx->usehuff);
+                }
+            } else {
+                int flags = policy == H2POLICY_NEVER ? 0x10 : 0x00;
+                if (sinx) {
+                    h2_hpack_putInt(buf, sinx, 4, flags);
+                } else {
+                    h2_buffer_put(buf, flags);
+                    h2_hpack_putString(buf, fld->name, fld->namelen, h2ctx->usehuff);
+                }
+            }
+            h2_hpack_putString(buf, fld->value, fld->vallen, h2ctx->usehuff);
+        }
+        fld->len = (uint16_t)(buf->used - fld->off);
+    }
+
+    /*
+     * The block is at most the encoded fields with each one replaced by an index.
+     * An index into a table of up to 64K entries fits in 4 bytes.  The offsets and
+     * lengths of the fields are 16 bits, so the encoded fields must fit in 64K.
+     */
+    bytes = buf->used <= 0xffff ? malloc(2*buf->used + 4*tmpl->count) : NULL;
+    if (!bytes) {
+        h2_buffer_free(buf);
+        return H2ERR_ALLOC;
+    }
+    free(tmpl->bytes);
+    tmpl->bytes = bytes;
+    tmpl->blockmax = buf->used + 4*tmpl->count;
+    tmpl->block = bytes + buf->used;
+    tmpl->blocklen = 0;
+    tmpl->policy_gen = h2_policy_gen;
+    tmpl->policy_serial = h2ctx->policy_serial;
+    memcpy(bytes, buf->buf, buf->used);
+    h2_buffer_free(buf);
+    return 0;
+}
+
+
+/*
+ * Free a header template
+ */
+void hpack_freeTemplate(h2_template_t * tmpl) {
+    if (tmpl) {
+        free(tmpl->bytes);
+        free(tmpl);
+    }
+}
+
+
+/*
+ * Encode the fields of a template
+ */
+static void hpack_templateFields(h2_context_t * h2ctx, h2_template_t * tmpl, h2_buffer_t * buf) {
+    h2_tmplfield_t * fld;
+    h2_newname_t nn;
+    int i;
+
+    for (i=0; i<tmpl->count; i++) {
+        fld = tmpl->fields + i;
+        if (fld->kind == H2TMPL_INDEX) {
+            /* The field is still in the table if fewer than entries fields have been added since */
+            if (fld->seq && h2ctx->inserts - fld->seq < h2ctx->entries) {
+                h2_hpack_putInt(buf, 62 + h2ctx->inserts - fld->seq, 7, 0x80);
+                h2ctx->fields++;
+                h2ctx->hits++;
+                continue;
+            }
+            hpack_resolveName(&nn, fld->name, fld->namelen, -1, NULL);
+            if (!hpack_pushEntry(h2ctx, &nn, fld->value, fld->vallen)) {
+                h2ctx->encodeField(h2ctx, fld->name, fld->namelen, fld->value, fld->vallen, buf);
+                continue;
+            }
+            fld->seq = h2ctx->inserts;
+        }
+        h2_buffer_putBytes(buf, tmpl->bytes + fld->off, fld->len);
+        h2ctx->fields++;
+    }
+}
+
+
+/*
+ * Encode a header block from a template
+ */
+int hpack_encodeTemplate(h2_context_t * h2ctx, h2_template_t * tmpl, char * src, int slen, h2_buffer_t * buf) {
+    uint32_t inserts;
+    uint32_t entries;
+    uint32_t hits;
+    int      start;
+    int      rc;
+    int      i;
+
+    if (!h2ctx || !tmpl || tmpl->h2ctx != h2ctx)
+        return -1;
+    if (src) {
+        slen = hpack_canonicalize(src, slen);
+        if (slen < 0)
+            return slen;
+    }
+    hpack_timeStart(h2ctx);
+    hpack_startBlock(h2ctx, buf);
+
+    if ((tmpl->policy_gen != h2_policy_gen || tmpl->policy_serial != h2ctx->policy_serial) &&
+            hpack_templateCompile(h2ctx, tmpl) < 0) {
+        /* Without the encoded fields each one is encoded as a header field */
+        for (i=0; i<tmpl->count; i++) {
+            h2ctx->encodeField(h2ctx, tmpl->fields[i].name, tmpl->fields[i].namelen, tmpl->fields[i].value,
+                    tmpl->fields[i].vallen, buf);
+        }
+    } else if (tmpl->blocklen && tmpl->block_inserts == h2ctx->inserts && tmpl->block_entries == h2ctx->entries) {
+        h2_buffer_putBytes(buf, tmpl->block, tmpl->blocklen);
+        h2ctx->fields += tmpl->count;
+        h2ctx->hits += tmpl->block_hits;
+    } else {
+        inserts = h2ctx->inserts;
+        entries = h2ctx->entries;
+        hits = h2ctx->hits;
+        start = buf->used;
+        hpack_templateFields(h2ctx, tmpl, buf);
+
+        /* Keep the block if it does not depend on entries added while encoding it */
+        tmpl->blocklen = 0;
+        if (h2ctx->inserts == inserts && h2ctx->entries == entries && buf->used - start <= tmpl->blockmax) {
+            memcpy(tmpl->block, buf->buf + start, buf->used - start);
+            tmpl->blocklen = buf->used - start;
+            tmpl->block_inserts = inserts;
+            tmpl->block_entries = entries;
+            tmpl->block_hits = h2ctx->hits - hits;
+        }
+    }
+    rc = src ? hpack_encodeLines(h2ctx, src, slen, buf) : 0;
+    hpack_endBlock(h2ctx);
+    return rc;
+}
+
+/*
+ * Decode an hpack header
+ *
+ * @param h2ctx  The hpack context
+ * @param src    The source compressed header.
+ * @param slen   The length of the source
+ * @param buf    The output buffer
+ * @return A return code, 0=good
+ */
+int hpack_decode(h2_context_t * h2ctx, const char * src, int slen, h2_buffer_t * buf) {
+    int rc = hpack_decodeBlock(h2ctx, src, slen, buf, NULL, 0);
+    return rc < 0 ? rc : 0;
+}
+
+
+/*
+ * Decode an hpack header into header fields
+ */
+int hpack_decodeFields(h2_context_t * h2ctx, const char * src, int slen, h2_buffer_t * buf,
+        h2_field_t * fields, int maxfields) {
+    return hpack_decodeBlock(h2ctx, src, slen, buf, fields, maxfields);
+}
+
+
+/*
+ * Decode a header block.
+ *
+ * If fields is NULL each field is written as a line, otherwise each field is written as
+ * a null terminated name and value and described in the field array.
+ * @return The number of fields, or a negative value to indicate an error
+ */
+static int hpack_decodeBlock(h2_context_t * h2ctx, const char * src, int slen, h2_buffer_t * buf,
+        h2_field_t * fields, int maxfields) {
+    char hdrbuf [512];
+    char valbuf [4096];
+    uint8_t infield = 0;
+    int  count = 0;
+    int  check = (h2ctx->decode_opt & H2DECODE_VALIDATE) ? H2CHAR_NAME | H2CHAR_VALUE : 0;
+    h2_use_t use = {0, 0};
+    const char * nl = "\n";
+
+    h2_buffer_t sbuf = {(char *)src, slen, slen};
+    while (sbuf.pos < slen) {
+        int      rc;
+        int      upper;
+        int      id;
+        uint32_t index;
+        const char * hdr;
+        const char * value;
+        int      hdrlen;
+        int      vallen;
+        char *   tofree = NULL;
+        const char * raw = NULL;
+        int      rawlen = 0;
+        uint8_t  freehdr = 0;
+        uint8_t  freeval = 0;
+        int      cls;
+
+        rc = h2_hpack_getInt(&sbuf, &index, 0, &upper);
+        if (rc < 0) {
+            return rc;
         } else {
-            idx = hpack_pushDynamic(h2ctx, hdr, value);
-            if (idx) {
-                if (inx == 0) {
-                    h2_buffer_put(buf, 0x40);
-                    h2_hpack_putString(buf, hdr, -1, h2ctx->usehuff);
-                    //printf("encode add0 %s: %s\n", hdr, value);
+            /* Check the limits before the field is copied or decoded */
+            if (h2ctx->limits && ((upper & 0xc0) || !(upper & 0x20))) {
+                rc = (upper & 0x80) ? hpack_limitIndex(h2ctx, &use, index) :
+                                      hpack_limitLiteral(h2ctx, &use, &sbuf, index);
+                if (rc < 0)
+                    return rc;
+            }
+            if (upper & 0x80) {
+                /* Indexed header */
+                if (index >= 62) {
+                    h2_entry_t * ent = hpack_getEntry(h2ctx, index);
+                    if (!ent)
+                        return H2ERR_INDEX;
+                    hdr = hpack_entryName(ent);
+                    hdrlen = ent->hdrlen;
+                    value = hpack_entryValue(ent);
+                    vallen = ent->valuelen;
+                    id = ent->nameinx;
+                } else {
+                    hdr = hpack_getHeader(h2ctx, index);
+                    if (!hdr)
+                        return H2ERR_INDEX;
+                    value = hpack_getValue(h2ctx, index);
+                    hdrlen = h2s_namelen[index];
+                    vallen = index < 17 ? h2s_vallen[index] : 0;
+                    id = h2s_first[index];
+                }
+            } else if (upper & 0x40) {
+                /* Dynamic add */
+                id = hpack_decodeInsert(h2ctx, &sbuf, index, &hdr, &hdrlen, &value, &vallen, &tofree,
+                        &raw, &rawlen);
+                if (id < 0) {
+                    if (tofree)
+                        free(tofree);
+                    return id;
+                }
+            } else if (upper & 0x20) {
+                /* Update dynamic table size.  This is only allowed at the start of the block */
+                if (infield)
+                    return H2ERR_TABLEUPDATE;
+                if (hpack_changeDynamic(h2ctx, index) < 0)
+                    return H2ERR_TABLESIZE;
+                continue;
+            } else {
+                /* Literal */
+                if (index == 0) {
+                    cls = check & H2CHAR_NAME;
+                    hdr = h2_hpack_getStringClass(&sbuf, hdrbuf, sizeof hdrbuf, &cls);
+                    if (!hdr)
+                        return H2ERR_LENGTH;
+                    freehdr = (char *)hdr != hdrbuf;
+                    hdrlen = (int)strlen(hdr);
+                    if (cls && (rc = hpack_checkClass(cls, hdr, hdrlen)) < 0) {
+                        if (freehdr)
+                            free((char *)hdr);
+                        return rc;
+                    }
+                    id = fields ? hpack_nameId(hdr, hdrlen, 0) : 0;
+                } else if (index < 62) {
+                    hdr = hpack_getHeader(h2ctx, index);
+                    if (!hdr)
+                        return H2ERR_INDEX;
+                    hdrlen = h2s_namelen[index];
+                    id = h2s_first[index];
+                } else {
+                    h2_entry_t * ent = hpack_getEntry(h2ctx, index);
+                    if (!ent)
+                        return H2ERR_INDEX;
+                    hdr = hpack_entryName(ent);
+                    hdrlen = ent->hdrlen;
+                    id = ent->nameinx;
+                }
+                if (fields && (h2ctx->decode_opt & H2DECODE_RAWHUFF) && sbuf.pos < slen &&
+                        (src[sbuf.pos] & 0x80)) {
+                    h2_buffer_t rbuf = sbuf;
+                    int huff;
+                    rawlen = hpack_getLiteral(&rbuf, &raw, &huff);
+                    if (rawlen < 0)
+                        rawlen = 0;
+                }
+                cls = check & H2CHAR_VALUE;
+                value = h2_hpack_getStringClass(&sbuf, valbuf, sizeof valbuf, &cls);
+                if (!value) {
+                    if (freehdr)
+                        free((char *)hdr);
+                    return H2ERR_LENGTH;
+                }
+                freeval = (char *)value != valbuf;
+                vallen = (int)strlen(value);
+                if (cls) {
+                    if (freehdr)
+                        free((char *)hdr);
+                    if (freeval)
+                        free((char *)value);
+                    return H2ERR_VALUECHAR;
+                }
+            }
+
+            infield = 1;
+            if (h2ctx->limits && !(upper & 0x80))
+                rc = hpack_limitField(h2ctx, &use, hdrlen + vallen);
+
+            if (rc < 0) {
+                /* Over a decode limit */
+            } else if (fields) {
+                /* Write the name and value and describe the field */
+                if (count >= maxfields) {
+                    rc = H2ERR_FIELDS;
+                } else {
+                    fields[count].id = (uint16_t)id;
+                    fields[count].namelen = (uint16_t)hdrlen;
+                    fields[count].name = buf->used;
+                    h2_buffer_putBytes(buf, hdr, hdrlen);
+                    h2_buffer_put(buf, 0);
+                    fields[count].vallen = vallen;
+                    fields[count].value = buf->used;
+                    h2_buffer_putBytes(buf, value, vallen);
+                    h2_buffer_put(buf, 0);
+                    fields[count].raw = 0;
+                    fields[count].rawlen = 0;
+                    if (rawlen && (h2ctx->decode_opt & H2DECODE_RAWHUFF)) {
+                        fields[count].raw = buf->used;
+                        fields[count].rawlen = rawlen;
+                        h2_buffer_putBytes(buf, raw, rawlen);
+                    }
+                    count++;
+                }
+            } else {
+                /* Write the line  */
+                h2_buffer_putBytes(buf, hdr, hdrlen);
+                h2_buffer_putString(buf, (h2ctx->decode_opt & H2DECODE_SPACE) ? ": " : ":");
+                h2_buffer_putBytes(buf, value, vallen);
+                h2_buffer_putString(buf, nl);
+                count++;
+            }
+            //printf("decode %s=%s\n", hdr, value);
+
+            /* Free if the hdr or value are in the heap */
+            if (freehdr)
+                free((char *)hdr);
+            if (freeval)
+                free((char *)value);
+            if (tofree)
+                free(tofree);
+            if (rc < 0)
+                return rc;
+        }
+        if (!fields) {
+            h2_buffer_put(buf, 0);
+            buf->used--;
+        }
+    }
+    return count;
+}
+
+
+
+/*
+ * Field references.
+ *
+ * While a block is decoded, a string in the output buffer is kept as its offset as the
+ * buffer can be reallocated, and a string in the dynamic table is kept as the insert
+ * number of its entry.  A new entry is always put in free space, so a later field in
+ * the block can only change an entry by evicting it, and an entry moved by compacting
+ * the table is found again by its index when the block is complete.
+ *
+ * When an arena is used, every string which is not in the static table is copied or
+ * decoded into the arena when the field is decoded, as arena memory does not move.
+ */
+
+/*
+ * Get a dynamic table entry by its insert number
+ */
+static h2_entry_t * hpack_refEntry(h2_context_t * h2ctx, uintptr_t seq) {
+    return hpack_getEntry(h2ctx, 62 + h2ctx->inserts - 1 - (uint32_t)seq);
+}
+
+
+/*
+ * Copy a string into an arena
+ */
+static const char * hpack_arenaCopy(h2_arena_t * arena, const char * str, int len) {
+    char * out = h2_arena_alloc(arena, len + 1);
+    if (out) {
+        memcpy(out, str, len);
+        out[len] = 0;
+    }
+    return out;
+}
+
+
+/*
+ * Reference the name, and for an indexed field the value, of a static or dynamic table entry
+ */
+static int hpack_refIndex(h2_context_t * h2ctx, h2_fieldref_t * ref, uint32_t index, int withvalue,
+        h2_arena_t * arena) {
+    if (index >= 62) {
+        h2_entry_t * ent = hpack_getEntry(h2ctx, index);
+        uintptr_t seq = h2ctx->inserts - 1 - (index - 62);
+        if (!ent)
+            return H2ERR_INDEX;
+        ref->namelen = ent->hdrlen;
+        ref->id = ent->nameinx;
+        if (ent->nametype == H2NAME_STATIC) {
+            ref->name = hpack_entryName(ent);
+        } else if (arena) {
+            ref->name = hpack_arenaCopy(arena, hpack_entryName(ent), ent->hdrlen);
+            ref->flags |= H2FIELD_NAMEBUF;
+            if (!ref->name)
+                return H2ERR_ALLOC;
+        } else {
+            ref->name = (const char *)seq;
+            ref->flags |= H2FIELD_NAMETABLE;
+        }
+        if (withvalue) {
+            ref->vallen = ent->valuelen;
+            if (arena) {
+                ref->value = hpack_arenaCopy(arena, hpack_entryValue(ent), ent->valuelen);
+                ref->flags |= H2FIELD_VALBUF;
+                if (!ref->value)
+                    return H2ERR_ALLOC;
+            } else {
+                ref->value = (const char *)seq;
+                ref->flags |= H2FIELD_VALTABLE;
+            }
+        }
+    } else {
+        ref->name = hpack_getHeader(h2ctx, index);
+        if (!ref->name)
+            return H2ERR_INDEX;
+        ref->namelen = h2s_namelen[index];
+        ref->id = h2s_first[index];
+        if (withvalue) {
+            ref->value = hpack_getValue(h2ctx, index);
+            ref->vallen = index < 17 ? h2s_vallen[index] : 0;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Reference a literal in the source, or huffman decode it into the output buffer.
+ * With an arena the literal is always copied or decoded into the arena.  If lazy is set
+ * a huffman literal is left in the source without being decoded.  If mask is set the
+ * literal is checked for the character classes H2CHAR_* in it.
+ * @return 0 if the string is in the source, 1 if it is in the buffer or arena,
+ *         2 if it is huffman encoded in the source, or a negative error
+ */
+static int hpack_refLiteral(h2_buffer_t * sbuf, const char * * str, uint32_t * len, h2_buffer_t * buf,
+        h2_arena_t * arena, int lazy, int mask) {
+    char * out;
+    int  slen;
+    int  huff;
+    int  max;
+    int  cls;
+
+    slen = hpack_getLiteral(sbuf, str, &huff);
+    if (slen < 0)
+        return slen;
+    if (arena) {
+        out = h2_arena_alloc(arena, huff ? slen*8/5 + 1 : slen + 1);
+        if (!out)
+            return H2ERR_ALLOC;
+        slen = hpack_putLiteral(out, *str, slen, huff, mask);
+        if (slen < 0)
+            return slen;
+        h2_arena_trim(arena, out, slen + 1);
+        *str = out;
+        *len = slen;
+        return 1;
+    }
+    if (!huff || lazy) {
+        if (mask && !huff) {
+            cls = h2_strClass(*str, slen, mask);
+            if (cls && (cls = hpack_checkClass(cls, *str, slen)) < 0)
+                return cls;
+        }
+        *len = slen;
+        return huff ? 2 : 0;
+    }
+    max = slen*8/5 + 1;
+    if (buf->used + max > buf->len) {
+        h2_buffer_ensure(buf, max);
+        if (buf->used + max > buf->len)
+            return H2ERR_ALLOC;
+    }
+    slen = hpack_putLiteral(buf->buf + buf->used, *str, slen, 1, mask);
+    if (slen < 0)
+        return slen;
+    *str = (const char *)(uintptr_t)buf->used;
+    *len = slen;
+    buf->used += slen + 1;
+    return 1;
+}
+
+
+/*
+ * Copy a string into the output buffer and return its offset
+ */
+static const char * hpack_refCopy(const char * str, int len, h2_buffer_t * buf) {
+    uintptr_t off = buf->used;
+    h2_buffer_putBytes(buf, str, len);
+    h2_buffer_put(buf, 0);
+    return (const char *)off;
+}
+
+
+/*
+ * Get the largest size of the entry added by a literal with incremental indexing
+ */
+static int hpack_insertBound(h2_context_t * h2ctx, h2_buffer_t * sbuf, uint32_t index) {
+    h2_buffer_t pbuf = *sbuf;
+    const char * str;
+    int  len;
+    int  huff;
+    int  bound = 32;
+
+    if (index >= 62) {
+        h2_entry_t * ent = hpack_getEntry(h2ctx, index);
+        if (!ent)
+            return H2ERR_INDEX;
+        bound += ent->hdrlen;
+    } else if (index) {
+        bound += h2s_namelen[index];
+    } else {
+        len = hpack_getLiteral(&pbuf, &str, &huff);
+        if (len < 0)
+            return len;
+        bound += huff ? len*8/5 : len;
+    }
+    len = hpack_getLiteral(&pbuf, &str, &huff);
+    if (len < 0)
+        return len;
+    return bound + (huff ? len*8/5 : len);
+}
+
+
+/*
+ * Copy the strings of the fields which reference entries that could be evicted by a new
+ * entry into the output buffer.  Entries are evicted from the tail until there is room.
+ */
+static void hpack_refPin(h2_context_t * h2ctx, h2_fieldref_t * refs, int count, int bound, h2_buffer_t * buf) {
+    h2_entry_t * ent = h2ctx->tail;
+    uint32_t room = h2ctx->current_size - h2ctx->used_size;
+    uintptr_t keep = h2ctx->inserts - h2ctx->entries;
+    int i;
+
+    while (ent && room < (uint32_t)bound) {
+        room += 32 + ent->hdrlen + ent->valuelen;
+        ent = ent->prev;
+        keep++;
+    }
+    for (i=0; i<count; i++) {
+        h2_fieldref_t * ref = refs + i;
+        if ((ref->flags & H2FIELD_NAMETABLE) && (uintptr_t)ref->name < keep) {
+            ref->name = hpack_refCopy(hpack_entryName(hpack_refEntry(h2ctx, (uintptr_t)ref->name)), ref->namelen, buf);
+            ref->flags ^= H2FIELD_NAMETABLE | H2FIELD_NAMEBUF;
+        }
+        if ((ref->flags & H2FIELD_VALTABLE) && (uintptr_t)ref->value < keep) {
+            ref->value = hpack_refCopy(hpack_entryValue(hpack_refEntry(h2ctx, (uintptr_t)ref->value)), ref->vallen, buf);
+            ref->flags ^= H2FIELD_VALTABLE | H2FIELD_VALBUF;
+        }
+    }
+}
+
+
+/*
+ * Reference a literal with incremental indexing which is decoded into the dynamic table
+ */
+static int hpack_refInsert(h2_context_t * h2ctx, h2_buffer_t * sbuf, uint32_t index, h2_fieldref_t * refs,
+        int count, int tabrefs, h2_buffer_t * buf, h2_arena_t * arena) {
+    h2_fieldref_t * ref = refs + count;
+    const char * hdr;
+    const char * value;
+    const char * raw;
+    char * tofree = NULL;
+    int  hdrlen;
+    int  vallen;
+    int  rawlen;
+    int  bound;
+    int  id;
+    uint32_t inserts = h2ctx->inserts;
+
+    if (tabrefs) {
+        bound = hpack_insertBound(h2ctx, sbuf, index);
+        if (bound < 0)
+            return bound;
+        hpack_refPin(h2ctx, refs, count, bound, buf);
+    }
+    id = hpack_decodeInsert(h2ctx, sbuf, index, &hdr, &hdrlen, &value, &vallen, &tofree, &raw, &rawlen);
+    if (id < 0) {
+        if (tofree)
+            free(tofree);
+        return id;
+    }
+    ref->id = (uint16_t)id;
+    ref->namelen = hdrlen;
+    ref->vallen = vallen;
+    if (arena) {
+        if (h2ctx->inserts != inserts && h2ctx->head->nametype == H2NAME_STATIC) {
+            ref->name = hdr;
+        } else {
+            ref->name = hpack_arenaCopy(arena, hdr, hdrlen);
+            ref->flags |= H2FIELD_NAMEBUF;
+        }
+        ref->value = hpack_arenaCopy(arena, value, vallen);
+        ref->flags |= H2FIELD_VALBUF;
+        if (!ref->name || !ref->value)
+            id = H2ERR_ALLOC;
+    } else if (h2ctx->inserts != inserts) {
+        if (h2ctx->head->nametype == H2NAME_STATIC) {
+            ref->name = hdr;
+        } else {
+            ref->name = (const char *)(uintptr_t)(h2ctx->inserts - 1);
+            ref->flags |= H2FIELD_NAMETABLE;
+        }
+        ref->value = (const char *)(uintptr_t)(h2ctx->inserts - 1);
+        ref->flags |= H2FIELD_VALTABLE;
+    } else {
+        /* The entry is larger than the table and is not added */
+        ref->name = hpack_refCopy(hdr, hdrlen, buf);
+        ref->value = hpack_refCopy(value, vallen, buf);
+        ref->flags |= H2FIELD_NAMEBUF | H2FIELD_VALBUF;
+    }
+    if (tofree)
+        free(tofree);
+    return id < 0 ? id : 0;
+}
+
+
+/*
+ * Decode an hpack header into references to the header fields
+ */
+int hpack_decodeRefs(h2_context_t * h2ctx, const char * src, int slen, h2_buffer_t * buf,
+        h2_fieldref_t * refs, int maxrefs) {
+    return hpack_decodeRefBlock(h2ctx, src, slen, buf, NULL, h2ctx->decode_opt & H2DECODE_LAZY, NULL, refs, maxrefs);
+}
+
+
+/*
+ * Decode an hpack header into header fields in an arena
+ */
+int hpack_decodeArena(h2_context_t * h2ctx, const char * src, int slen, h2_arena_t * arena,
+        h2_fieldref_t * refs, int maxrefs) {
+    if (!arena)
+        return H2ERR_ALLOC;
+    return hpack_decodeRefBlock(h2ctx, src, slen, NULL, arena, 0, NULL, refs, maxrefs);
+}
+
+
+/*
+ * Decode a value which was left huffman encoded in the source
+ */
+int hpack_refValue(h2_fieldref_t * ref, h2_arena_t * arena) {
+    char * out;
+    int  len;
+
+    if (!(ref->flags & H2FIELD_VALHUFF))
+        return (int)ref->vallen;
+    if (!arena)
+        return H2ERR_ALLOC;
+    out = h2_arena_alloc(arena, ref->vallen*8/5 + 1);
+    if (!out)
+        return H2ERR_ALLOC;
+    len = hpack_putLiteral(out, ref->value, ref->vallen, 1, 0);
+    if (len < 0)
+        return len;
+    if ((uint32_t)len > ref->maxlen) {
+        h2_arena_trim(arena, out, 0);
+        return H2ERR_FIELDSIZE;
+    }
+    h2_arena_trim(arena, out, len + 1);
+    ref->value = out;
+    ref->vallen = len;
+    ref->flags = (ref->flags & ~(H2FIELD_VALSRC | H2FIELD_VALHUFF)) | H2FIELD_VALBUF;
+    return len;
+}
+
+
+/*
+ * HTTP/1.1 transcoding.
+ *
+ * The block is decoded into field references, and the head is built as a list of parts
+ * which point to the decoded strings and to constant text.  The parts are returned for
+ * writev, or copied into the output buffer once the total length is known, so each
+ * string is copied at most once after it is decoded.  The references and parts are on
+ * the stack, and are only allocated for a block with more fields.
+ */
+#define H2HTTP1_FIELDS  128               /* The fields in the references on the stack */
+#define H2HTTP1_PARTS   (4*H2HTTP1_FIELDS + 16)
+
+/*
+ * Add a part to the list of parts
+ */
+#define H2PART(ptr, plen) \
+    if (n >= maxiov) \
+        return H2ERR_FIELDS; \
+    iov[n].base = (ptr); \
+    iov[n].len = (plen); \
+    n++;
+
+
+/*
+ * Check that a start line token has only visible ASCII characters, so it can not end
+ * the token or the line early.  The method must also be a valid name token.
+ */
+static int hpack_http1Token(const h2_fieldref_t * ref, int method) {
+    const uint8_t * p = (const uint8_t *)ref->value;
+    uint32_t i;
+
+    if (!ref->vallen)
+        return 0;
+    for (i=0; i<ref->vallen; i++) {
+        if (p[i] <= ' ' || p[i] >= 0x7f)
+            return 0;
+    }
+    if (method && h2_strClass(ref->value, ref->vallen, H2CHAR_NAMEBAD | H2CHAR_COLON))
+        return 0;
+    return 1;
+}
+
+
+/*
+ * Build the parts of an HTTP/1.1 head from decoded fields.
+ * A request line is built from :method and :path, or from :method and :authority for
+ * CONNECT, and a status line from :status.  A block without pseudo-header fields is
+ * written as a trailer section.  :authority is written as host unless there is a host
+ * field, the cookie crumbs are joined into one field, and other pseudo-header fields
+ * are not written.  Every name and value is checked whatever the decoder options, as a
+ * CR or LF would start a new line in the head.
+ * @return The number of parts, or a negative error
+ */
+static int hpack_http1Parts(const h2_fieldref_t * refs, int count, h2_iovec_t * iov, int maxiov) {
+    const h2_fieldref_t * method = NULL;
+    const h2_fieldref_t * path = NULL;
+    const h2_fieldref_t * authority = NULL;
+    const h2_fieldref_t * status = NULL;
+    const h2_fieldref_t * ref;
+    int  host = 0;
+    int  cookies = 0;
+    int  connect;
+    int  n = 0;
+    int  rc;
+    int  i;
+
+    for (i=0; i<count; i++) {
+        ref = refs + i;
+        if (!ref->namelen)
+            return H2ERR_NAMECHAR;
+        rc = hpack_checkClass(h2_strClass(ref->name, ref->namelen, H2CHAR_NAME), ref->name, ref->namelen);
+        if (rc == 0)
+            rc = hpack_checkClass(h2_strClass(ref->value, ref->vallen, H2CHAR_VALUE), ref->value, ref->vallen);
+        if (rc < 0)
+            return rc;
+        switch (ref->id) {
+        case H2ID_METHOD:
+            if (method)
+                return H2ERR_PSEUDO;
+            method = ref;
+            break;
+        case H2ID_PATH:
+            if (path)
+                return H2ERR_PSEUDO;
+            path = ref;
+            break;
+        case H2ID_AUTHORITY:
+            if (authority)
+                return H2ERR_PSEUDO;
+            authority = ref;
+            break;
+        case H2ID_STATUS:
+            if (status)
+                return H2ERR_PSEUDO;
+            status = ref;
+            break;
+        case H2ID_HOST:
+            host = 1;
+            break;
+        case H2ID_COOKIE:
+            cookies++;
+            break;
+        }
+    }
+
+    /* The start line */
+    if (status) {
+        if (method || path || authority || status->vallen != 3 || !isdigit((uint8_t)status->value[0]) ||
+                !isdigit((uint8_t)status->value[1]) || !isdigit((uint8_t)status->value[2]))
+            return H2ERR_PSEUDO;
+        H2PART("HTTP/1.1 ", 9);
+        H2PART(status->value, status->vallen);
+        H2PART(" \r\n", 3);
+    } else if (method) {
+        connect = method->vallen == 7 && !memcmp(method->value, "CONNECT", 7);
+        if (connect ? (path || !authority) : (!path || !path->vallen))
+            return H2ERR_PSEUDO;
+        if (connect)
+            path = authority;
+        if (!hpack_http1Token(method, 1) || !hpack_http1Token(path, 0) ||
+                (authority && !hpack_http1Token(authority, 0)))
+            return H2ERR_PSEUDO;
+        H2PART(method->value, method->vallen);
+        H2PART(" ", 1);
+        H2PART(path->value, path->vallen);
+        H2PART(" HTTP/1.1\r\n", 11);
+        if (authority && !host) {
+            H2PART("host: ", 6);
+            H2PART(authority->value, authority->vallen);
+            H2PART("\r\n", 2);
+        }
+    } else if (path || authority) {
+        return H2ERR_PSEUDO;
+    }
+
+    /* The fields, with the cookie crumbs joined at the end */
+    for (i=0; i<count; i++) {
+        ref = refs + i;
+        if (ref->id == H2ID_COOKIE || (ref->namelen && *ref->name == ':'))
+            continue;
+        H2PART(ref->name, ref->namelen);
+        H2PART(": ", 2);
+        H2PART(ref->value, ref->vallen);
+        H2PART("\r\n", 2);
+    }
+    if (cookies) {
+        H2PART("cookie: ", 8);
+        for (i=0; i<count; i++) {
+            ref = refs + i;
+            if (ref->id != H2ID_COOKIE)
+                continue;
+            H2PART(ref->value, ref->vallen);
+            if (--cookies) {
+                H2PART("; ", 2);
+            }
+        }
+        H2PART("\r\n", 2);
+    }
+    H2PART("\r\n", 2);
+    return n;
+}
+
+
+/*
+ * Count the fields in a header block without decoding the strings.
+ * The count stops at the first representation which does not fit in the block.
+ */
+static int hpack_countFields(const char * src, int slen) {
+    h2_buffer_t sbuf = {(char *)src, slen, slen};
+    const char * str;
+    uint32_t index;
+    int  upper;
+    int  huff;
+    int  count = 0;
+
+    while (sbuf.pos < slen) {
+        if (h2_hpack_getInt(&sbuf, &index, 0, &upper) < 0)
+            break;
+        if (!(upper & 0xc0) && (upper & 0x20))
+            continue;                     /* Dynamic table size update */
+        count++;
+        if (upper & 0x80)
+            continue;
+        if ((!index && hpack_getLiteral(&sbuf, &str, &huff) < 0) || hpack_getLiteral(&sbuf, &str, &huff) < 0)
+            break;
+    }
+    return count;
+}
+
+
+/*
+ * Decode an hpack header into the parts of an HTTP/1.1 head
+ */
+int hpack_decodeHttp1Iov(h2_context_t * h2ctx, const char * src, int slen, h2_buffer_t * work,
+        h2_iovec_t * iov, int maxiov) {
+    h2_fieldref_t local[H2HTTP1_FIELDS];
+    h2_fieldref_t * refs = NULL;
+    int  maxrefs = hpack_countFields(src, slen);
+    int  count;
+
+    /* Without memory for the references the whole block still updates the table */
+    if (maxrefs > H2HTTP1_FIELDS)
+        refs = malloc(maxrefs * sizeof(h2_fieldref_t));
+    if (!refs) {
+        refs = local;
+        maxrefs = H2HTTP1_FIELDS;
+    }
+    count = hpack_decodeRefBlock(h2ctx, src, slen, work, NULL, 0, NULL, refs, maxrefs);
+    if (count >= 0)
+        count = hpack_http1Parts(refs, count, iov, maxiov);
+    if (refs != local)
+        free(refs);
+    return count;
+}
+
+
+/*
+ * Decode an hpack header into an HTTP/1.1 head
+ */
+int hpack_decodeHttp1(h2_context_t * h2ctx, const char * src, int slen, h2_buffer_t * buf) {
+    h2_iovec_t local[H2HTTP1_PARTS];
+    h2_iovec_t * iov = NULL;
+    char workbuf[4096];
+    h2_buffer_t work = {workbuf, sizeof workbuf};
+    char * out;
+    int  maxiov = 4*hpack_countFields(src, slen) + 16;
+    int  len = 0;
+    int  n;
+    int  i;
+
+    if (maxiov > H2HTTP1_PARTS)
+        iov = malloc(maxiov * sizeof(h2_iovec_t));
+    if (!iov) {
+        iov = local;
+        maxiov = H2HTTP1_PARTS;
+    }
+    n = hpack_decodeHttp1Iov(h2ctx, src, slen, &work, iov, maxiov);
+    if (n >= 0) {
+        for (i=0; i<n; i++)
+            len += (int)iov[i].len;
+        h2_buffer_ensure(buf, len + 1);
+        if (buf->used + len + 1 > buf->len) {
+            n = H2ERR_ALLOC;
+        } else {
+            out = buf->buf + buf->used;
+            for (i=0; i<n; i++) {
+                if (iov[i].len)
+                    memcpy(out, iov[i].base, iov[i].len);
+                out += iov[i].len;
+            }
+            *out = 0;
+            buf->used += len;
+        }
+    }
+    if (iov != local)
+        free(iov);
+    h2_buffer_free(&work);
+    return n < 0 ? n : len;
+}
+
+
+/*
+ * Track decoding.
+ *
+ * A proxy which forwards header blocks without changing them must still keep its
+ * decoder table the same as the encoder.  The track decoder only does the work which
+ * changes the table, which is decoding the literals with incremental indexing, and
+ * skips over the other literals.  The fields with one of a few configured names are
+ * returned.  A literal name is matched against the name and its huffman encoding
+ * without decoding it, as the huffman encoding of a string is unique.
+ */
+#define H2TRACK_MAX     8                 /* The most names which are tracked */
+#define H2TRACK_NAMELEN 64                /* The longest tracked name plus one */
+
+typedef struct h2_trackname_t {
+    uint16_t id;                          /* The header ID of the name */
+    uint8_t  len;                         /* The length of the name */
+    uint8_t  hufflen;                     /* The length of the huffman encoded name */
+    char     name[H2TRACK_NAMELEN];       /* The lower case name */
+    char     huff[2*H2TRACK_NAMELEN];     /* The huffman encoded name */
+} h2_trackname_t;
+
+struct h2_track_t {
+    int      count;
+    h2_trackname_t names[H2TRACK_MAX];
+};
+
+
+/*
+ * Set the names of the fields returned by hpack_decodeTrack
+ */
+int hpack_setTrackNames(h2_context_t * h2ctx, const char * const * names, int count) {
+    struct h2_track_t * track;
+    h2_trackname_t * tn;
+    int  len;
+    int  i;
+    int  j;
+
+    if (h2ctx->encode || count < 0 || count > H2TRACK_MAX)
+        return -1;
+    for (i=0; i<count; i++) {
+        len = (int)strlen(names[i]);
+        if (!len || len >= H2TRACK_NAMELEN || (h2_strClass(names[i], len, H2CHAR_NAME) & H2CHAR_NAMEBAD))
+            return -1;
+    }
+    if (!count) {
+        if (h2ctx->track)
+            free(h2ctx->track);
+        h2ctx->track = NULL;
+        return 0;
+    }
+    track = h2ctx->track;
+    if (!track) {
+        track = malloc(sizeof(struct h2_track_t));
+        if (!track)
+            return H2ERR_ALLOC;
+        h2ctx->track = track;
+    }
+    for (i=0; i<count; i++) {
+        tn = track->names + i;
+        tn->len = (uint8_t)strlen(names[i]);
+        for (j=0; j<tn->len; j++)
+            tn->name[j] = (char)tolower((uint8_t)names[i][j]);
+        tn->name[j] = 0;
+        tn->id = (uint16_t)hpack_getHeaderId(tn->name, tn->len);
+        tn->hufflen = (uint8_t)h2_str2huf(tn->name, tn->len, tn->huff, sizeof tn->huff);
+    }
+    track->count = count;
+    return 0;
+}
+
+
+/*
+ * Find a tracked name.  A name in the static table is matched by its index, and a
+ * literal name which is huffman encoded is matched by its encoding.
+ * @return The tracked name, or NULL if the name is not tracked
+ */
+static h2_trackname_t * hpack_trackMatch(struct h2_track_t * track, uint32_t index, const char * name,
+        int len, int huff) {
+    h2_trackname_t * tn = track->names;
+    int  i;
+
+    for (i=0; i<track->count; i++, tn++) {
+        if (index && index < 62) {
+            if (tn->id == h2s_first[index])
+                return tn;
+        } else if (huff) {
+            if (tn->hufflen == len && !memcmp(tn->huff, name, len))
+                return tn;
+        } else {
+            if (tn->len == len && !memcmp(tn->name, name, len))
+                return tn;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Decode the rest of a header block for its changes to the dynamic table, and return
+ * the fields with a tracked name.  Fields is the number of fields already in the block.
+ * Once the array of fields is full the rest of the block is still decoded, and then
+ * H2ERR_FIELDS is returned.
+ */
+static int hpack_trackFields(h2_context_t * h2ctx, h2_buffer_t * sbuf, struct h2_track_t * track,
+        int fields, h2_use_t * use, h2_buffer_t * buf, h2_fieldref_t * refs, int maxrefs) {
+    int  check = (h2ctx->decode_opt & H2DECODE_VALIDATE) ? H2CHAR_VALUE : 0;
+    int  count = 0;
+    int  full = 0;
+    int  i;
+
+    while (sbuf->pos < sbuf->used) {
+        h2_trackname_t * tn = NULL;
+        h2_fieldref_t * ref;
+        const char * name;
+        const char * value;
+        uint32_t index;
+        int      namelen;
+        int      vallen;
+        int      huff;
+        int      upper;
+        int      rep;
+        int      rc;
+
+        rc = h2_hpack_getInt(sbuf, &index, 0, &upper);
+        if (rc < 0)
+            return rc;
+        if (!(upper & 0xc0) && (upper & 0x20)) {
+            /* Update dynamic table size.  This is only allowed at the start of the block */
+            if (fields)
+                return H2ERR_TABLEUPDATE;
+            if (hpack_changeDynamic(h2ctx, index) < 0)
+                return H2ERR_TABLESIZE;
+            continue;
+        }
+        if (h2ctx->limits) {
+            rc = (upper & 0x80) ? hpack_limitIndex(h2ctx, use, index) :
+                                  hpack_limitLiteral(h2ctx, use, sbuf, index);
+            if (rc < 0)
+                return rc;
+        }
+        fields++;
+        rep = (upper & 0x80) ? H2REP_INDEXED : (upper & 0x40) ? H2REP_INCREMENTAL :
+              (upper & 0x10) ? H2REP_NEVER : H2REP_NOINDEX;
+
+        if (rep == H2REP_INCREMENTAL) {
+            /* The literal is decoded into the table, and copied out if it is tracked */
+            char * tofree = NULL;
+            const char * raw;
+            int  rawlen;
+            rc = hpack_decodeInsert(h2ctx, sbuf, index, &name, &namelen, &value, &vallen, &tofree,
+                    &raw, &rawlen);
+            if (rc >= 0 && h2ctx->limits)
+                rc = hpack_limitField(h2ctx, use, (uint64_t)namelen + vallen);
+            if (rc >= 0 && track && (tn = hpack_trackMatch(track, 0, name, namelen, 0)) != NULL) {
+                if (count >= maxrefs) {
+                    full = 1;
+                    tn = NULL;
                 } else {
-                    h2_hpack_putInt(buf, inx, 6, 0x40);
-                    //printf("encode addx %s=%d: %s\n", hdr, inx, value);
+                    ref = refs + count;
+                    ref->id = (uint16_t)rc;
+                    ref->value = hpack_refCopy(value, vallen, buf);
+                    ref->vallen = vallen;
+                    ref->flags = H2FIELD_VALBUF;
                 }
+            }
+            if (tofree)
+                free(tofree);
+            if (rc < 0)
+                return rc;
+        } else if (rep == H2REP_INDEXED) {
+            /* An indexed field is checked, but only a tracked field is copied */
+            h2_entry_t * ent = NULL;
+            if (index >= 62) {
+                ent = hpack_getEntry(h2ctx, index);
+                if (!ent)
+                    return H2ERR_INDEX;
+                if (track)
+                    tn = hpack_trackMatch(track, 0, hpack_entryName(ent), ent->hdrlen, 0);
             } else {
-                if (inx == 0) {
-                    h2_buffer_put(buf, 0x00);
-                    h2_hpack_putString(buf, hdr, -1, h2ctx->usehuff);
-                    //printf("encode 0 %s: %s\n", hdr, value);
+                if (!index)
+                    return H2ERR_INDEX;
+                if (track)
+                    tn = hpack_trackMatch(track, index, NULL, 0, 0);
+            }
+            if (tn && count >= maxrefs) {
+                full = 1;
+                tn = NULL;
+            }
+            if (tn) {
+                ref = refs + count;
+                ref->id = ent ? ent->nameinx : h2s_first[index];
+                if (ent) {
+                    ref->value = hpack_refCopy(hpack_entryValue(ent), ent->valuelen, buf);
+                    ref->vallen = ent->valuelen;
+                    ref->flags = H2FIELD_VALBUF;
                 } else {
-                    h2_hpack_putInt(buf, inx, 4, 0x00);
-                    //printf("encode x %s=%d: %s\n", hdr, inx, value);
+                    ref->value = hpack_getValue(h2ctx, index);
+                    ref->vallen = index < 17 ? h2s_vallen[index] : 0;
+                    ref->flags = 0;
                 }
             }
-            h2_hpack_putString(buf, value, -1, h2ctx->usehuff);
+        } else {
+            /* A literal which is not indexed is only decoded if it is tracked */
+            huff = 0;
+            if (index >= 62) {
+                h2_entry_t * ent = hpack_getEntry(h2ctx, index);
+                if (!ent)
+                    return H2ERR_INDEX;
+                name = hpack_entryName(ent);
+                namelen = ent->hdrlen;
+            } else if (index) {
+                name = NULL;
+                namelen = h2s_namelen[index];
+            } else {
+                namelen = hpack_getLiteral(sbuf, &name, &huff);
+                if (namelen < 0)
+                    return namelen;
+            }
+            if (track)
+                tn = hpack_trackMatch(track, index, name, namelen, huff);
+            if (tn && count >= maxrefs) {
+                full = 1;
+                tn = NULL;
+            }
+            if (tn) {
+                ref = refs + count;
+                rc = hpack_refLiteral(sbuf, &ref->value, &ref->vallen, buf, NULL, 0, check);
+                if (rc < 0)
+                    return rc;
+                ref->id = tn->id;
+                ref->flags = rc ? H2FIELD_VALBUF : H2FIELD_VALSRC;
+                namelen = tn->len;
+                vallen = ref->vallen;
+            } else {
+                vallen = hpack_getLiteral(sbuf, &value, &huff);
+                if (vallen < 0)
+                    return vallen;
+                if (huff)
+                    vallen = vallen*8/30;
+                if (!index && huff)
+                    namelen = namelen*8/30;
+            }
+            /* A string which is not decoded is counted with the shortest length it can decode to */
+            if (h2ctx->limits) {
+                rc = hpack_limitField(h2ctx, use, (uint64_t)namelen + vallen);
+                if (rc < 0)
+                    return rc;
+            }
         }
+        if (tn) {
+            ref = refs + count;
+            ref->name = tn->name;
+            ref->namelen = tn->len;
+            ref->rep = (uint8_t)rep;
+            count++;
+        }
+    }
 
+    if (full)
+        return H2ERR_FIELDS;
 
-        hdr = next+1;
-        next = strchr(hdr, '\n');
-        if (next)
-            *next = 0;
+    /* Set the values in the buffer now they do not move */
+    for (i=0; i<count; i++) {
+        if (refs[i].flags & H2FIELD_VALBUF)
+            refs[i].value = buf->buf + (uintptr_t)refs[i].value;
     }
-    return 0;
+    return count;
+}
+
+
+/*
+ * Decode an hpack header only for its changes to the dynamic table
+ */
+int hpack_decodeTrack(h2_context_t * h2ctx, const char * src, int slen, h2_buffer_t * buf,
+        h2_fieldref_t * refs, int maxrefs) {
+    h2_buffer_t sbuf = {(char *)src, slen, slen};
+    h2_use_t use = {0, 0};
 
+    return hpack_trackFields(h2ctx, &sbuf, h2ctx->track, 0, &use, buf, refs, maxrefs);
 }
 
+
 /*
- * Decode an hpack header
+ * Route matching.
  *
- * @param h2ctx  The hpack context
- * @param src    The source compressed header.
- * @param slen   The length of the source
- * @param buf    The output buffer
- * @return A return code, 0=good
+ * The routes are a radix trie with a key of the authority, a space and the path.  The
+ * key of a route for any authority starts with the space.  The :authority and :path
+ * fields of a block are matched as they are decoded, and a huffman encoded path is
+ * matched a part at a time as it is decoded, so a path with no route is rejected
+ * without decoding the rest of it.  The matching of a path ends at a '?'.
  */
-int hpack_decode(h2_context_t * h2ctx, const char * src, int slen, h2_buffer_t * buf) {
-    char hdrbuf [512];
-    char valbuf [4096];
-    uint8_t freehdr = 0;
-    uint8_t freeval = 0;
-    const char * nl = "\n";
+#define H2ROUTE_CHUNK  16                 /* The huffman bytes of a path decoded at a time */
+
+typedef struct h2_rnode_t {
+    struct h2_rnode_t * child;            /* The first child */
+    struct h2_rnode_t * next;             /* The next sibling */
+    char *   label;                       /* The bytes of the edge to this node */
+    uint32_t len;                         /* The length of the label */
+    int      route;                       /* The route of the key which ends here or -1 */
+    int      prefix;                      /* The route of the keys which start with this or -1 */
+} h2_rnode_t;
+
+struct h2_routes_t {
+    h2_rnode_t root;
+    int      hosts;                       /* The routes for a given authority */
+};
+
+typedef struct h2_rmatch_t {
+    const h2_rnode_t * node;              /* The node being matched or NULL if none matches */
+    uint32_t pos;                         /* The bytes of the node label which are matched */
+    int      best;                        /* The route of the longest prefix matched or -1 */
+    int      done;                        /* The end of the path has been found */
+} h2_rmatch_t;
+
+struct h2_route_t {
+    const h2_routes_t * routes;
+    h2_rmatch_t host;                     /* The match of the routes for the authority */
+    h2_rmatch_t any;                      /* The match of the routes for any authority */
+    int      hostref;                     /* The :authority field or -1 */
+    int      pathref;                     /* The :path field or -1 */
+    int      hostfirst;                   /* The host match was started before the path */
+    int      rejected;                    /* No route can match the path */
+    int      settled;                     /* The rest of the path can not change the route */
+    int      route;                       /* The route of the block */
+};
+
+
+/*
+ * Create a node with a copy of the label
+ */
+static h2_rnode_t * hpack_newNode(const char * label, int len) {
+    h2_rnode_t * node = malloc(sizeof(h2_rnode_t) + len);
+    if (node) {
+        memset(node, 0, sizeof(h2_rnode_t));
+        node->label = (char *)(node + 1);
+        memcpy(node->label, label, len);
+        node->len = len;
+        node->route = node->prefix = -1;
+    }
+    return node;
+}
+
+
+/*
+ * Free the children of a node
+ */
+static void hpack_freeNodes(h2_rnode_t * node) {
+    h2_rnode_t * child;
+    while ((child = node->child) != NULL) {
+        node->child = child->next;
+        hpack_freeNodes(child);
+        free(child);
+    }
+}
+
+
+/*
+ * Create an empty set of routes
+ */
+h2_routes_t * hpack_newRoutes(void) {
+    h2_routes_t * routes = calloc(1, sizeof(h2_routes_t));
+    if (routes)
+        routes->root.route = routes->root.prefix = -1;
+    return routes;
+}
+
+
+/*
+ * Free a set of routes
+ */
+void hpack_freeRoutes(h2_routes_t * routes) {
+    if (routes) {
+        hpack_freeNodes(&routes->root);
+        free(routes);
+    }
+}
+
+
+/*
+ * Insert a key into the trie.  An edge is split where the key leaves it.
+ */
+static int hpack_routeInsert(h2_rnode_t * node, const char * key, int len, int route, int prefix) {
+    h2_rnode_t * child;
+    h2_rnode_t * tail;
+    uint32_t n;
+
+    while (len) {
+        for (child=node->child; child && child->label[0] != *key; child=child->next);
+        if (!child) {
+            child = hpack_newNode(key, len);
+            if (!child)
+                return H2ERR_ALLOC;
+            child->next = node->child;
+            node->child = child;
+            node = child;
+            break;
+        }
+        for (n=0; n<child->len && n<(uint32_t)len && child->label[n] == key[n]; n++);
+        if (n < child->len) {
+            tail = hpack_newNode(child->label + n, child->len - n);
+            if (!tail)
+                return H2ERR_ALLOC;
+            tail->child = child->child;
+            tail->route = child->route;
+            tail->prefix = child->prefix;
+            child->child = tail;
+            child->len = n;
+            child->route = child->prefix = -1;
+        }
+        node = child;
+        key += n;
+        len -= n;
+    }
+    if (prefix)
+        node->prefix = route;
+    else
+        node->route = route;
+    return 0;
+}
+
+
+/*
+ * Add a route
+ */
+int hpack_addRoute(h2_routes_t * routes, const char * authority, const char * path, int route) {
+    char * key;
+    int  alen = authority ? (int)strlen(authority) : 0;
+    int  plen = (int)strlen(path);
+    int  prefix;
+    int  rc;
+    int  i;
+
+    if (route < 0 || *path != '/' || strchr(path, '?') || strchr(path, ' '))
+        return -1;
+    if (authority && (strchr(authority, ' ') || strchr(authority, '?')))
+        return -1;
+    prefix = path[plen-1] == '*';
+    if (prefix)
+        plen--;
+    key = malloc(alen + 1 + plen);
+    if (!key)
+        return H2ERR_ALLOC;
+    for (i=0; i<alen; i++)
+        key[i] = (char)tolower((uint8_t)authority[i]);
+    key[alen] = ' ';
+    memcpy(key + alen + 1, path, plen);
+    rc = hpack_routeInsert(&routes->root, key, alen + 1 + plen, route, prefix);
+    free(key);
+    if (rc == 0 && alen)
+        routes->hosts++;
+    return rc;
+}
+
+
+/*
+ * Start matching from the root of the routes
+ */
+static void hpack_matchStart(h2_rmatch_t * m, const h2_routes_t * routes) {
+    m->node = &routes->root;
+    m->pos = 0;
+    m->best = -1;
+    m->done = 0;
+}
+
+
+/*
+ * Match the next bytes of a key.  The bytes in the label of a node are compared together.
+ */
+static void hpack_matchFeed(h2_rmatch_t * m, const char * str, int len) {
+    const h2_rnode_t * node = m->node;
+    uint32_t pos = m->pos;
+    const char * query;
+    int  n;
+    int  i;
+
+    if (m->done || !node)
+        return;
+    query = memchr(str, '?', len);
+    if (query) {
+        len = (int)(query - str);
+        m->done = 1;
+    }
+    while (len) {
+        if (pos == node->len) {
+            for (node=node->child; node && node->label[0] != *str; node=node->next);
+            pos = 0;
+            if (!node)
+                break;
+        }
+        n = node->len - pos;
+        if (n > len)
+            n = len;
+        for (i=0; i<n && node->label[pos+i] == str[i]; i++);
+        if (i < n) {
+            node = NULL;
+            break;
+        }
+        pos += n;
+        str += n;
+        len -= n;
+        if (pos == node->len && node->prefix >= 0)
+            m->best = node->prefix;
+    }
+    m->node = node;
+    m->pos = pos;
+}
+
+
+/*
+ * Get the route of a match.  A route for the whole key is used before a prefix.
+ */
+static int hpack_matchEnd(const h2_rmatch_t * m) {
+    if (m->node && m->pos == m->node->len && m->node->route >= 0)
+        return m->node->route;
+    return m->best;
+}
+
+
+/*
+ * Match part of the path.  The path is rejected when no route can match it.
+ */
+static void hpack_routePath(h2_route_t * rt, const char * str, int len) {
+    hpack_matchFeed(&rt->any, str, len);
+    if (rt->hostfirst)
+        hpack_matchFeed(&rt->host, str, len);
+    if (!rt->any.node && rt->any.best < 0) {
+        if (rt->hostfirst ? !rt->host.node && rt->host.best < 0 : !rt->routes->hosts)
+            rt->rejected = 1;
+    }
+    if ((!rt->any.node || rt->any.done) && (!rt->hostfirst || !rt->host.node || rt->host.done))
+        rt->settled = 1;
+}
+
+
+/*
+ * Get a value which is decoded, before the references to the buffer and table are set
+ */
+static const char * hpack_refNow(h2_context_t * h2ctx, const h2_fieldref_t * ref, h2_buffer_t * buf) {
+    if (ref->flags & H2FIELD_VALBUF)
+        return buf->buf + (uintptr_t)ref->value;
+    if (ref->flags & H2FIELD_VALTABLE)
+        return hpack_entryValue(hpack_refEntry(h2ctx, (uintptr_t)ref->value));
+    return ref->value;
+}
+
+
+/*
+ * Match the :authority field, or the :path field if it was not matched as it was decoded
+ */
+static void hpack_routeField(h2_context_t * h2ctx, h2_route_t * rt, const h2_fieldref_t * ref, int count,
+        h2_buffer_t * buf) {
+    if (ref->id == H2ID_AUTHORITY && rt->hostref < 0) {
+        rt->hostref = count;
+        if (rt->pathref < 0) {
+            rt->hostfirst = 1;
+            hpack_matchStart(&rt->host, rt->routes);
+            hpack_matchFeed(&rt->host, hpack_refNow(h2ctx, ref, buf), ref->vallen);
+            hpack_matchFeed(&rt->host, " ", 1);
+        }
+    } else if (ref->id == H2ID_PATH && rt->pathref < 0) {
+        rt->pathref = count;
+        hpack_routePath(rt, hpack_refNow(h2ctx, ref, buf), ref->vallen);
+    }
+}
+
+
+/*
+ * Decode a :path literal into the output buffer, and match it as it is decoded.  A
+ * huffman encoded path is decoded a part at a time, and the decoding stops if the path
+ * is rejected.  Once the route is settled the rest of the path is decoded together.
+ * @return 0 if the path is in the source, 1 if it is in the buffer, or a negative error
+ */
+static int hpack_routeLiteral(h2_route_t * rt, h2_buffer_t * sbuf, h2_fieldref_t * ref, h2_buffer_t * buf,
+        int mask) {
+    h2_hufstate_t hs = {0, 0, 0};
+    const char * str;
+    uintptr_t off;
+    int  slen;
+    int  huff;
+    int  max;
+    int  part;
+    int  n = 0;
+    int  i;
+    int  rc;
+
+    slen = hpack_getLiteral(sbuf, &str, &huff);
+    if (slen < 0)
+        return slen;
+    if (!huff) {
+        if (mask && (rc = h2_strClass(str, slen, mask)) && (rc = hpack_checkClass(rc, str, slen)) < 0)
+            return rc;
+        hpack_routePath(rt, str, slen);
+        ref->value = str;
+        ref->vallen = slen;
+        return 0;
+    }
+    max = slen*8/5 + 1;
+    if (buf->used + max > buf->len) {
+        h2_buffer_ensure(buf, max);
+        if (buf->used + max > buf->len)
+            return H2ERR_ALLOC;
+    }
+    off = buf->used;
+    for (i=0; i<slen && !rt->rejected; i+=part) {
+        part = slen - i < H2ROUTE_CHUNK || rt->settled ? slen - i : H2ROUTE_CHUNK;
+        rc = h2_huf2strPart(&hs, str + i, part, buf->buf + off + n, max - n, i + part == slen);
+        if (rc < 0)
+            return H2ERR_HUFFMAN;
+        if (!rt->settled)
+            hpack_routePath(rt, buf->buf + off + n, rc);
+        n += rc;
+    }
+    if (rt->rejected)
+        return 1;
+    if ((hs.cls & mask) && (rc = hpack_checkClass(hs.cls & mask, buf->buf + off, n)) < 0)
+        return rc;
+    buf->buf[off + n] = 0;
+    buf->used += n + 1;
+    ref->value = (const char *)off;
+    ref->vallen = n;
+    return 1;
+}
+
+
+/*
+ * Get the route of a block once the field references are set.  If the :authority field
+ * was after the :path field the routes for the authority are matched now.
+ */
+static int hpack_routeEnd(h2_route_t * rt, const h2_fieldref_t * refs) {
+    int  route = -1;
+
+    if (rt->rejected || rt->pathref < 0)
+        return H2ROUTE_NONE;
+    if (!rt->hostfirst && rt->hostref >= 0 && rt->routes->hosts) {
+        hpack_matchStart(&rt->host, rt->routes);
+        hpack_matchFeed(&rt->host, refs[rt->hostref].value, refs[rt->hostref].vallen);
+        hpack_matchFeed(&rt->host, " ", 1);
+        hpack_matchFeed(&rt->host, refs[rt->pathref].value, refs[rt->pathref].vallen);
+        rt->hostfirst = 1;
+    }
+    if (rt->hostfirst)
+        route = hpack_matchEnd(&rt->host);
+    if (route < 0)
+        route = hpack_matchEnd(&rt->any);
+    return route < 0 ? H2ROUTE_NONE : route;
+}
+
+
+/*
+ * Decode an hpack header into references to the header fields and match its route
+ */
+int hpack_decodeRoute(h2_context_t * h2ctx, const char * src, int slen, h2_buffer_t * buf,
+        const h2_routes_t * routes, int * route, h2_fieldref_t * refs, int maxrefs) {
+    h2_route_t rt;
+    int  count;
 
+    memset(&rt, 0, sizeof rt);
+    rt.routes = routes;
+    rt.hostref = rt.pathref = -1;
+    hpack_matchStart(&rt.any, routes);
+    hpack_matchFeed(&rt.any, " ", 1);
+    count = hpack_decodeRefBlock(h2ctx, src, slen, buf, NULL, 0, &rt, refs, maxrefs);
+    *route = count < 0 ? H2ROUTE_NONE : rt.route;
+    return count;
+}
+
+
+/*
+ * Decode a header block into field references.
+ * The strings are in the output buffer, or in the arena if one is given.  If lazy is set
+ * huffman encoded values which are not added to the table are left in the source.  If rt
+ * is set the route of the block is matched, and once the route is rejected the rest of
+ * the block only updates the dynamic table.
+ */
+static int hpack_decodeRefBlock(h2_context_t * h2ctx, const char * src, int slen, h2_buffer_t * buf,
+        h2_arena_t * arena, int lazy, h2_route_t * rt, h2_fieldref_t * refs, int maxrefs) {
     h2_buffer_t sbuf = {(char *)src, slen, slen};
+    int  check = (h2ctx->decode_opt & H2DECODE_VALIDATE) ? H2CHAR_NAME | H2CHAR_VALUE : 0;
+    h2_use_t use = {0, 0};
+    int  count = 0;
+    int  tabrefs = 0;
+    int  i;
+
     while (sbuf.pos < slen) {
-        int      rc;
-        int      upper;
+        h2_fieldref_t * ref;
         uint32_t index;
-        const char * hdr;
-        const char * value;
+        int      start = sbuf.pos;
+        int      upper;
+        int      rc;
 
         rc = h2_hpack_getInt(&sbuf, &index, 0, &upper);
-        if (rc < 0) {
+        if (rc < 0)
             return rc;
+        if (!(upper & 0xc0) && (upper & 0x20)) {
+            /* Update dynamic table size.  This is only allowed at the start of the block */
+            if (count)
+                return H2ERR_TABLEUPDATE;
+            if (hpack_changeDynamic(h2ctx, index) < 0)
+                return H2ERR_TABLESIZE;
+            continue;
+        }
+        if (count >= maxrefs) {
+            /* The rest of the block is applied to the table so it stays in step with the peer */
+            sbuf.pos = start;
+            rc = hpack_trackFields(h2ctx, &sbuf, NULL, count, &use, NULL, NULL, 0);
+            return rc < 0 ? rc : H2ERR_FIELDS;
+        }
+        if (h2ctx->limits) {
+            rc = (upper & 0x80) ? hpack_limitIndex(h2ctx, &use, index) :
+                                  hpack_limitLiteral(h2ctx, &use, &sbuf, index);
+            if (rc < 0)
+                return rc;
+        }
+        ref = refs + count;
+        ref->flags = 0;
+        ref->maxlen = 0xffffffff;
+        if (upper & 0x80) {
+            ref->rep = H2REP_INDEXED;
+            rc = hpack_refIndex(h2ctx, ref, index, 1, arena);
+        } else if (upper & 0x40) {
+            ref->rep = H2REP_INCREMENTAL;
+            rc = hpack_refInsert(h2ctx, &sbuf, index, refs, count, tabrefs, buf, arena);
         } else {
-            if (upper & 0x80) {
-                /* Indexed header */
-                hdr = hpack_getHeader(h2ctx, index);
-                value = hpack_getValue(h2ctx, index);
-            } else if (upper & 0x40) {
-                /* Dynamic add */
-                if (index == 0) {
-                    hdr = h2_hpack_getString(&sbuf, hdrbuf, sizeof hdrbuf);
-                    freehdr = (char *)hdr != hdrbuf;
-                } else {
-                    hdr = hpack_getHeader(h2ctx, index);
-                }
-                value = h2_hpack_getString(&sbuf, valbuf, sizeof valbuf);
-                freeval = (char *)value != valbuf;
-                rc = hpack_pushDynamic(h2ctx, hdr, value);
-                /* TODO: error handling */
-            } else if (upper & 0x20) {
-                /* Update dynamic table size */
-                hpack_changeDynamic(h2ctx, index);
-                continue;
+            ref->rep = (upper & 0x10) ? H2REP_NEVER : H2REP_NOINDEX;
+            if (index) {
+                rc = hpack_refIndex(h2ctx, ref, index, 0, arena);
             } else {
-                /* Literal */
-                if (index == 0) {
-                    hdr = h2_hpack_getString(&sbuf, hdrbuf, sizeof hdrbuf);
-                    freehdr = (char *)hdr != hdrbuf;
-                } else {
-                    hdr = hpack_getHeader(h2ctx, index);
+                rc = hpack_refLiteral(&sbuf, &ref->name, &ref->namelen, buf, arena, 0, check & H2CHAR_NAME);
+                if (rc >= 0) {
+                    ref->flags |= rc ? H2FIELD_NAMEBUF : H2FIELD_NAMESRC;
+                    ref->id = (uint16_t)hpack_nameId(rc && !arena ? buf->buf + (uintptr_t)ref->name : ref->name,
+                            ref->namelen, 0);
                 }
-                value = h2_hpack_getString(&sbuf, valbuf, sizeof valbuf);
-                freeval = (char *)value != valbuf;
             }
+            if (rc >= 0 && rt && ref->id == H2ID_PATH && rt->pathref < 0) {
+                rt->pathref = count;
+                rc = hpack_routeLiteral(rt, &sbuf, ref, buf, check & H2CHAR_VALUE);
+                if (rc >= 0)
+                    ref->flags |= rc ? H2FIELD_VALBUF : H2FIELD_VALSRC;
+            } else if (rc >= 0) {
+                rc = hpack_refLiteral(&sbuf, &ref->value, &ref->vallen, buf, arena,
+                        lazy && !check, check & H2CHAR_VALUE);
+                if (rc >= 0)
+                    ref->flags |= rc == 1 ? H2FIELD_VALBUF : rc ? H2FIELD_VALSRC | H2FIELD_VALHUFF : H2FIELD_VALSRC;
+            }
+        }
+        if (rc < 0)
+            return rc;
+        if (rt) {
+            hpack_routeField(h2ctx, rt, ref, count, buf);
+            if (rt->rejected) {
+                /* The fields so far are copied out of the table before it is changed */
+                hpack_refPin(h2ctx, refs, count, h2ctx->current_size + 1, buf);
+                rc = hpack_trackFields(h2ctx, &sbuf, NULL, count + 1, &use, NULL, NULL, 0);
+                if (rc < 0)
+                    return rc;
+                break;
+            }
+        }
+        if (h2ctx->limits && !(upper & 0x80)) {
+            /*
+             * A value left in the source is counted with the shortest length it can decode
+             * to, and keeps the room the limits leave for it to be checked when it is decoded
+             */
+            if (ref->flags & H2FIELD_VALHUFF) {
+                uint64_t room = 0xffffffff;
+                if (h2ctx->max_field && h2ctx->max_field - (uint64_t)ref->namelen < room)
+                    room = h2ctx->max_field - (uint64_t)ref->namelen;
+                if (h2ctx->max_list && h2ctx->max_list - use.list - 32 - (uint64_t)ref->namelen < room)
+                    room = h2ctx->max_list - use.list - 32 - (uint64_t)ref->namelen;
+                ref->maxlen = (uint32_t)room;
+            }
+            rc = hpack_limitField(h2ctx, &use, (uint64_t)ref->namelen +
+                    ((ref->flags & H2FIELD_VALHUFF) ? ref->vallen*8/30 : ref->vallen));
+            if (rc < 0)
+                return rc;
+        }
+        if (ref->flags & (H2FIELD_NAMETABLE | H2FIELD_VALTABLE))
+            tabrefs++;
+        count++;
+    }
+
+    /* Set the strings in the buffer and the dynamic table now they do not move */
+    for (i=0; i<count && !arena; i++) {
+        h2_fieldref_t * ref = refs + i;
+        if (ref->flags & H2FIELD_NAMEBUF)
+            ref->name = buf->buf + (uintptr_t)ref->name;
+        else if (ref->flags & H2FIELD_NAMETABLE)
+            ref->name = hpack_entryName(hpack_refEntry(h2ctx, (uintptr_t)ref->name));
+        if (ref->flags & H2FIELD_VALBUF)
+            ref->value = buf->buf + (uintptr_t)ref->value;
+        else if (ref->flags & H2FIELD_VALTABLE)
+            ref->value = hpack_entryValue(hpack_refEntry(h2ctx, (uintptr_t)ref->value));
+    }
+    if (rt)
+        rt->route = hpack_routeEnd(rt, refs);
+    return count;
+}
+
+
+
+/*
+ * Incremental decoding.
+ *
+ * The partial decoder is a state machine which is given the header block in parts of
+ * any size.  An integer or string which is split between parts is kept as a partial
+ * value, and a huffman encoded string is decoded as its bytes arrive.  Each field is
+ * returned as soon as it is complete, with its strings in the arena of the caller.
+ */
+#define H2PART_FIELD   0                  /* At the start of a field */
+#define H2PART_INT     1                  /* In the continuation bytes of an integer */
+#define H2PART_STRLEN  2                  /* At the start of a string */
+#define H2PART_STRING  3                  /* In the bytes of a string */
+
+#define H2PART_INDEX   0                  /* The integer is the index of a field */
+#define H2PART_LENGTH  1                  /* The integer is the length of a string */
+
+#define H2PART_MAXSTRING 0x1000000        /* The longest string when there is no field size limit */
+
+struct h2_partial_t {
+    h2_context_t * h2ctx;
+    uint8_t  state;                       /* The state H2PART_* */
+    uint8_t  intfor;                      /* What the integer is for */
+    uint8_t  upper;                       /* The representation bits of the field */
+    uint8_t  huff;                        /* The string is huffman encoded */
+    uint8_t  invalue;                     /* The string is the value */
+    uint8_t  infield;                     /* A field has been decoded in this block */
+    uint8_t  resv[2];
+    uint32_t intval;                      /* The integer value */
+    int      shift;                       /* The shift of the next integer byte */
+    uint32_t index;                       /* The index of the field or name */
+    uint32_t left;                        /* The bytes of the string still to come */
+    char *   str;                         /* The output of the string in the arena */
+    uint32_t len;                         /* The bytes of output */
+    uint32_t max;                         /* The room for output */
+    h2_hufstate_t hs;                     /* The state of a huffman string */
+    h2_fieldref_t field;                  /* The field being decoded */
+    h2_use_t use;                         /* The use of the decode limits by the block */
+};
+
+
+/*
+ * Create a partial decoder
+ */
+h2_partial_t * hpack_newPartial(h2_context_t * h2ctx) {
+    h2_partial_t * pd;
+    if (!h2ctx || h2ctx->encode)
+        return NULL;
+    pd = calloc(1, sizeof(h2_partial_t));
+    if (pd)
+        pd->h2ctx = h2ctx;
+    return pd;
+}
+
+
+/*
+ * Free a partial decoder
+ */
+void hpack_freePartial(h2_partial_t * pd) {
+    if (pd)
+        free(pd);
+}
+
+
+/*
+ * Add a decoded literal with incremental indexing to the dynamic table.
+ * The name and value are in the arena so they are not changed by evicting entries.
+ */
+static int hpack_partialInsert(h2_partial_t * pd) {
+    h2_context_t * h2ctx = pd->h2ctx;
+    h2_fieldref_t * fld = &pd->field;
+    h2_entry_t * nent = NULL;
+    h2_entry_t * ent;
+    h2_newname_t nn;
+    char * valpos;
+    int  entlen;
+    int  rc;
+    int  need;
+
+    if (pd->index >= 62)
+        nent = hpack_getEntry(h2ctx, pd->index);
+    hpack_resolveName(&nn, fld->name, fld->namelen, pd->index && pd->index < 62 ? (int)pd->index : -1, nent);
+
+    /* An entry larger than the table empties the table and is not added */
+    entlen = 32 + fld->namelen + fld->vallen;
+    if (entlen > (int)h2ctx->current_size) {
+        hpack_reduceDynamic(h2ctx, h2ctx->current_size+1);
+        if (nn.type == H2NAME_SHARED)
+            hpack_releaseName(nn.shared);
+        return 0;
+    }
+    hpack_reduceDynamic(h2ctx, entlen);
+    need = offsetof(h2_entry_t, hdr) + hpack_nameBytes(nn.type, nn.len) + fld->vallen + 1;
+    ent = hpack_reserveDynamic(h2ctx, need);
+    rc = ent ? 0 : hpack_resizeTable(h2ctx, h2ctx->alloc_size);
+    if (!ent && rc == 0)
+        ent = hpack_reserveDynamic(h2ctx, need);
+    if (!ent) {
+        if (nn.type == H2NAME_SHARED)
+            hpack_releaseName(nn.shared);
+        return rc < 0 ? rc : H2ERR_ENTRYSIZE;
+    }
+    valpos = hpack_putName(ent, &nn);
+    memcpy(valpos, fld->value, fld->vallen);
+    valpos[fld->vallen] = 0;
+    hpack_linkEntry(h2ctx, ent, nn.len, fld->vallen);
+    return 0;
+}
+
+
+/*
+ * Start a string once its length is known.
+ * The length comes from the peer, so it is checked before the output is allocated.  A
+ * string is limited by the field size limit and never longer than H2PART_MAXSTRING, and
+ * one which is to be added to the dynamic table is also limited by the table size.  A huffman string is rejected when
+ * even its shortest decoding is too long, and its output is allocated only up to the
+ * limit, so a longer decoding runs out of room and is rejected as it arrives.
+ */
+static int hpack_partialString(h2_partial_t * pd, h2_arena_t * arena) {
+    h2_context_t * h2ctx = pd->h2ctx;
+    uint64_t maxlen = h2ctx->max_field ? h2ctx->max_field : H2PART_MAXSTRING;
+    uint64_t size;
+
+    if (maxlen > H2PART_MAXSTRING)
+        maxlen = H2PART_MAXSTRING;
+    if (pd->field.rep == H2REP_INCREMENTAL && maxlen > h2ctx->current_size)
+        maxlen = h2ctx->current_size;
+    size = pd->huff ? (uint64_t)pd->left*8/30 : pd->left;
+    if (size > maxlen)
+        return H2ERR_FIELDSIZE;
+    size = pd->huff ? (uint64_t)pd->left*8/5 : pd->left;
+    pd->max = (uint32_t)(size < maxlen ? size : maxlen) + 1;
+    pd->str = h2_arena_alloc(arena, (int)pd->max);
+    if (!pd->str)
+        return H2ERR_ALLOC;
+    pd->len = 0;
+    pd->hs.a = 0;
+    pd->hs.bits = 0;
+    pd->hs.cls = 0;
+    pd->state = H2PART_STRING;
+    return 0;
+}
+
+
+/*
+ * Act on an integer once it is complete.
+ * @return 1 if a field is complete, 0 if not, or a negative error
+ */
+static int hpack_partialInt(h2_partial_t * pd, h2_arena_t * arena) {
+    h2_context_t * h2ctx = pd->h2ctx;
+    uint32_t value = pd->intval;
+    int rc;
+
+    if (pd->intfor == H2PART_LENGTH) {
+        pd->left = value;
+        if (h2ctx->limits) {
+            rc = hpack_limitSize(h2ctx, &pd->use, (pd->invalue ? (uint64_t)pd->field.namelen : 0) +
+                    (pd->huff ? (uint64_t)value*8/30 : value));
+            if (rc < 0)
+                return rc;
+        }
+        return hpack_partialString(pd, arena);
+    }
+    pd->index = value;
+    pd->state = H2PART_FIELD;
+    if (!(pd->upper & 0xc0) && (pd->upper & 0x20)) {
+        /* Update dynamic table size.  This is only allowed at the start of the block */
+        if (pd->infield)
+            return H2ERR_TABLEUPDATE;
+        if (hpack_changeDynamic(h2ctx, value) < 0)
+            return H2ERR_TABLESIZE;
+        return 0;
+    }
+    pd->infield = 1;
+    if (pd->upper & 0x80) {
+        if (h2ctx->limits && (rc = hpack_limitIndex(h2ctx, &pd->use, value)) < 0)
+            return rc;
+        rc = hpack_refIndex(h2ctx, &pd->field, value, 1, arena);
+        return rc < 0 ? rc : 1;
+    }
+    if (h2ctx->max_fields && pd->use.fields >= h2ctx->max_fields)
+        return H2ERR_FIELDCOUNT;
+    if (value) {
+        rc = hpack_refIndex(h2ctx, &pd->field, value, 0, arena);
+        if (rc < 0)
+            return rc;
+        pd->invalue = 1;
+    } else {
+        pd->invalue = 0;
+    }
+    pd->state = H2PART_STRLEN;
+    return 0;
+}
+
+
+/*
+ * Decode the next part of a header block
+ */
+int hpack_decodePartial(h2_partial_t * pd, const char * src, int slen, int last, h2_arena_t * arena,
+        h2_fieldref_t * refs, int maxrefs) {
+    h2_fieldref_t * fld = &pd->field;
+    int  check = pd->h2ctx->decode_opt & H2DECODE_VALIDATE;
+    int  count = 0;
+    int  pos = 0;
+    int  rc = 0;
+    int  n;
+
+    if (!arena)
+        return H2ERR_ALLOC;
+    while (pos < slen || (pd->state == H2PART_STRING && !pd->left)) {
+        switch (pd->state) {
+        case H2PART_FIELD: {
+            uint8_t ch = (uint8_t)src[pos++];
+            int bits = (ch & 0x80) ? 7 : (ch & 0x40) ? 6 : (ch & 0x20) ? 5 : 4;
+            uint32_t maxval = (1 << bits) - 1;
+            pd->upper = ch & ~maxval;
+            fld->flags = 0;
+            fld->rep = (ch & 0x80) ? H2REP_INDEXED : (ch & 0x40) ? H2REP_INCREMENTAL :
+                       (ch & 0x10) ? H2REP_NEVER : H2REP_NOINDEX;
+            pd->intfor = H2PART_INDEX;
+            pd->intval = ch & maxval;
+            pd->shift = 0;
+            if (pd->intval == maxval)
+                pd->state = H2PART_INT;
+            else
+                rc = hpack_partialInt(pd, arena);
+            break;
+        }
+        case H2PART_STRLEN: {
+            uint8_t ch = (uint8_t)src[pos++];
+            pd->huff = ch & 0x80;
+            pd->intfor = H2PART_LENGTH;
+            pd->intval = ch & 0x7f;
+            pd->shift = 0;
+            if (pd->intval == 0x7f)
+                pd->state = H2PART_INT;
+            else
+                rc = hpack_partialInt(pd, arena);
+            break;
+        }
+        case H2PART_INT: {
+            uint8_t ch = (uint8_t)src[pos++];
+            if (pd->shift > 28)
+                return H2ERR_LENGTH;              /* The value does not fit in 32 bits */
+            pd->intval += (uint32_t)(ch & 0x7f) << pd->shift;
+            pd->shift += 7;
+            if (!(ch & 0x80))
+                rc = hpack_partialInt(pd, arena);
+            break;
+        }
+        case H2PART_STRING:
+            n = slen - pos < (int)pd->left ? slen - pos : (int)pd->left;
+            if (pd->huff) {
+                rc = h2_huf2strPart(&pd->hs, src + pos, n, pd->str + pd->len, pd->max - pd->len - 1,
+                        n == (int)pd->left);
+                if (rc < 0)
+                    return rc == -3 ? H2ERR_FIELDSIZE : H2ERR_HUFFMAN;   /* -3 is out of room */
+                pd->len += rc;
+                rc = 0;
+            } else {
+                memcpy(pd->str + pd->len, src + pos, n);
+                if (check)
+                    pd->hs.cls |= h2_strClass(src + pos, n, pd->invalue ? H2CHAR_VALUE : H2CHAR_NAME);
+                pd->len += n;
+            }
+            pos += n;
+            pd->left -= n;
+            if (pd->left)
+                break;
 
-            /* Write the line  */
-            h2_buffer_putString(buf, hdr);
-            h2_buffer_putString(buf, (h2ctx->decode_opt==H2DECODE_SPACE) ? ": " : ":");
-            h2_buffer_putString(buf, value);
-            h2_buffer_putString(buf, nl);
-            //printf("decode %s=%s\n", hdr, value);
-
-            /* Free if the hdr or value are in the heap */
-            if (freehdr)
-                free((char *)hdr);
-            if (freeval)
-                free((char *)value);
+            /* The string is complete */
+            pd->str[pd->len] = 0;
+            h2_arena_trim(arena, pd->str, pd->len + 1);
+            if (check && (pd->hs.cls & (pd->invalue ? H2CHAR_VALUE : H2CHAR_NAME))) {
+                rc = hpack_checkClass(pd->hs.cls & (pd->invalue ? H2CHAR_VALUE : H2CHAR_NAME), pd->str, pd->len);
+                if (rc < 0)
+                    return rc;
+            }
+            pd->state = H2PART_STRLEN;
+            if (!pd->invalue) {
+                fld->name = pd->str;
+                fld->namelen = pd->len;
+                fld->id = (uint16_t)hpack_nameId(pd->str, pd->len, 0);
+                fld->flags |= H2FIELD_NAMEBUF;
+                pd->invalue = 1;
+                break;
+            }
+            fld->value = pd->str;
+            fld->vallen = pd->len;
+            fld->flags |= H2FIELD_VALBUF;
+            pd->state = H2PART_FIELD;
+            if (pd->h2ctx->limits) {
+                rc = hpack_limitField(pd->h2ctx, &pd->use, (uint64_t)fld->namelen + fld->vallen);
+                if (rc < 0)
+                    return rc;
+            }
+            rc = 1;
+            if (fld->rep == H2REP_INCREMENTAL) {
+                n = hpack_partialInsert(pd);
+                if (n < 0)
+                    return n;
+            }
+            break;
+        }
+        if (rc < 0)
+            return rc;
+        if (rc) {
+            if (count >= maxrefs)
+                return H2ERR_FIELDS;
+            refs[count++] = *fld;
+            rc = 0;
         }
-        h2_buffer_put(buf, 0);
-        buf->used--;
     }
-    return 0;
+    if (last) {
+        if (pd->state != H2PART_FIELD)
+            return H2ERR_LENGTH;                  /* The block ends within a field */
+        pd->infield = 0;
+        pd->use.list = 0;
+        pd->use.fields = 0;
+    }
+    return count;
 }
 
 
@@ -501,30 +4287,69 @@ int hpack_decode(h2_context_t * h2ctx, const char * src, int slen, h2_buffer_t *
  */
 
 int hpack_pushDynamic(h2_context_t * h2ctx, const char * hdr, const char * value) {
-    int where;
-    int hdrlen = (int)strlen(hdr);
-    int vallen = (int)strlen(value);
-    int entlen = 32+hdrlen+vallen;
-    h2_entry_t * ent;
+    h2_newname_t nn;
+    hpack_resolveName(&nn, hdr, (int)strlen(hdr), -1, NULL);
+    return hpack_pushEntry(h2ctx, &nn, value, (int)strlen(value));
+}
+
+
+/*
+ * Push an entry with a resolved name into the dynamic table.
+ * If the entry is not pushed, any shared name is released.
+ */
+static int hpack_pushEntry(h2_context_t * h2ctx, h2_newname_t * nn, const char * value, int vallen) {
+    return hpack_pushEntryOpt(h2ctx, nn, value, vallen, h2ctx->encode_opt);
+}
+
+
+/*
+ * Push an entry with the encoder option as an argument
+ */
+static XFORCEINLINE int hpack_pushEntryOpt(h2_context_t * h2ctx, h2_newname_t * nn, const char * value,
+        int vallen, const int opt) {
+    int entlen = 32+nn->len+vallen;
 
     /*
      * If the entry does not fit in the table, or we choose to not use dynamic, return 0
      */
-    if (entlen > h2ctx->current_size || entlen > h2ctx->max_entry_size || h2ctx->encode_opt < H2ENCODE_MIN) {
-        return 0;
-    }
-    if (h2ctx->encode_opt == H2ENCODE_MIN && entlen > (h2ctx->current_size - h2ctx->used_size)) {
+    if (entlen > h2ctx->current_size || entlen > h2ctx->max_entry_size || opt < H2ENCODE_MIN ||
+        (opt == H2ENCODE_MIN && entlen > (h2ctx->current_size - h2ctx->used_size))) {
+        if (nn->type == H2NAME_SHARED)
+            hpack_releaseName(nn->shared);
         return 0;
     }
+    return hpack_insertName(h2ctx, nn, value, vallen);
+}
+
+
+/*
+ * Insert an entry into the dynamic table evicting old entries as required.
+ * The caller has already decided that the entry should be added.
+ */
+int hpack_insertDynamic(h2_context_t * h2ctx, const char * hdr, int hdrlen, const char * value, int vallen) {
+    h2_newname_t nn;
+    hpack_resolveName(&nn, hdr, hdrlen, -1, NULL);
+    return hpack_insertName(h2ctx, &nn, value, vallen);
+}
+
+
+/*
+ * Insert an entry with a resolved name into the dynamic table.
+ * A shared name must already have a reference for this entry.  An inline name must
+ * not be in an entry which could be evicted by this insert.
+ */
+static int hpack_insertName(h2_context_t * h2ctx, h2_newname_t * nn, const char * value, int vallen) {
+    int where;
+    int entlen = 32+nn->len+vallen;
+    h2_entry_t * ent;
+    char * valpos;
 
     /* Throw out enough old entries that we have space */
     hpack_reduceDynamic(h2ctx, entlen);
 
     /* Insert a new entry */
     if (h2ctx->head) {
-        ent = h2ctx->head;
-        where = ((char *)h2ctx->head) - h2ctx->dyntab + 30 + ent->hdrlen + ent->valuelen;
-        where &= ~7;
+        where = hpack_nextWhere(h2ctx);
         if (where + entlen > h2ctx->alloc_size) {
             where = 0;
         }
@@ -532,6 +4357,169 @@ int hpack_pushDynamic(h2_context_t * h2ctx, const char * hdr, const char * value
         where = 0;
     }
     ent = (h2_entry_t *)(h2ctx->dyntab + where);
+    valpos = hpack_putName(ent, nn);
+    memcpy(valpos, value, vallen);
+    valpos[vallen] = 0;
+    hpack_linkEntry(h2ctx, ent, nn->len, vallen);
+    return 62;
+}
+
+
+/*
+ * Get the number of bytes used by the name in an entry
+ */
+static int hpack_nameBytes(int nametype, int hdrlen) {
+    switch (nametype) {
+    case H2NAME_STATIC:  return 0;
+    case H2NAME_SHARED:  return sizeof(h2_name_t *);
+    default:             return hdrlen + 1;
+    }
+}
+
+
+/*
+ * Get the number of bytes used by an entry not including the alignment pad
+ */
+static int hpack_entrySize(const h2_entry_t * ent) {
+    return offsetof(h2_entry_t, hdr) + hpack_nameBytes(ent->nametype, ent->hdrlen) + ent->valuelen + 1;
+}
+
+
+/*
+ * Get the shared name of an entry.
+ * The pointer follows the entry header and is not aligned.
+ */
+static h2_name_t * hpack_entryShared(const h2_entry_t * ent) {
+    h2_name_t * shared;
+    memcpy(&shared, ent->hdr, sizeof(h2_name_t *));
+    return shared;
+}
+
+
+/*
+ * Get the name of an entry
+ */
+static const char * hpack_entryName(const h2_entry_t * ent) {
+    switch (ent->nametype) {
+    case H2NAME_STATIC:  return h2_static[ent->nameinx];
+    case H2NAME_SHARED:  return hpack_entryShared(ent)->name;
+    default:             return ent->hdr;
+    }
+}
+
+
+/*
+ * Get the value of an entry
+ */
+static char * hpack_entryValue(const h2_entry_t * ent) {
+    return (char *)ent->hdr + hpack_nameBytes(ent->nametype, ent->hdrlen);
+}
+
+
+/*
+ * Put the name part of a new entry and return the location for the value.
+ * The name length is set in the entry when it is linked.
+ */
+static char * hpack_putName(h2_entry_t * ent, h2_newname_t * nn) {
+    ent->nametype = nn->type;
+    ent->nameinx = nn->inx;
+    switch (nn->type) {
+    case H2NAME_STATIC:
+        return ent->hdr;
+    case H2NAME_SHARED:
+        memcpy(ent->hdr, &nn->shared, sizeof(h2_name_t *));
+        return ent->hdr + sizeof(h2_name_t *);
+    default:
+        memcpy(ent->hdr, nn->name, nn->len);
+        ent->hdr[nn->len] = 0;
+        return ent->hdr + nn->len + 1;
+    }
+}
+
+
+/*
+ * Resolve how the name of a new entry is kept.
+ *
+ * A name from the static table is kept as its index, and an interned name points to
+ * the interned copy.  If there is an existing entry with the same name, a name which
+ * is long enough is shared with that entry, taking a reference on the shared name and
+ * creating it if this is the second use.  Otherwise the name is copied into the entry.
+ * The header ID of the name is kept in the entry so it is known without a lookup when
+ * the entry is used.
+ *
+ * @param nn     The resolved name (output)
+ * @param hdr    The name, or NULL if it is not yet known
+ * @param hdrlen The length of the name
+ * @param id     The static table index or header ID of the name, or -1 if it is not known
+ * @param src    An existing entry with the same name or NULL.  If the ID is not known
+ *               it is taken from this entry, or looked up if the entry has no ID.
+ */
+static void hpack_resolveName(h2_newname_t * nn, const char * hdr, int hdrlen, int id, const h2_entry_t * src) {
+    nn->name = hdr;
+    nn->len = hdrlen;
+    nn->type = H2NAME_INLINE;
+    nn->shared = NULL;
+    if (id < 0 && src && src->nameinx)
+        id = src->nameinx;
+    if (id < 0)
+        id = hdr ? hpack_nameId(hdr, hdrlen, 0) : 0;
+    nn->inx = (uint8_t)id;
+
+    if (id > 0 && id < 62) {
+        /* Use the first static entry with this name */
+        id = h2s_first[id];
+        nn->type = H2NAME_STATIC;
+        nn->inx = (uint8_t)id;
+        nn->name = h2_static[id];
+        nn->len = h2s_namelen[id];
+    } else if (id >= H2ID_INTERN && hdrlen >= H2NAME_MINSHARE) {
+        nn->type = H2NAME_SHARED;
+        nn->shared = h2_intern.names[id - H2ID_INTERN];
+        nn->name = nn->shared->name;
+    } else if (src && src->nametype == H2NAME_SHARED) {
+        nn->type = H2NAME_SHARED;
+        nn->shared = hpack_entryShared(src);
+        if (nn->shared->refs != H2NAME_INTERNED)
+            nn->shared->refs++;
+        nn->name = nn->shared->name;
+    } else if (src && hdrlen >= H2NAME_MINSHARE) {
+        h2_name_t * shared = malloc(offsetof(h2_name_t, name) + hdrlen + 1);
+        if (shared) {
+            shared->refs = 1;
+            shared->len = hdrlen;
+            memcpy(shared->name, hdr, hdrlen);
+            shared->name[hdrlen] = 0;
+            nn->type = H2NAME_SHARED;
+            nn->shared = shared;
+            nn->name = shared->name;
+        }
+    }
+}
+
+
+/*
+ * Release a reference to a shared name
+ */
+static void hpack_releaseName(h2_name_t * shared) {
+    if (shared->refs != H2NAME_INTERNED && --shared->refs == 0)
+        free(shared);
+}
+
+
+/*
+ * Get the offset in the table following the head entry
+ */
+static int hpack_nextWhere(h2_context_t * h2ctx) {
+    h2_entry_t * ent = h2ctx->head;
+    return (((char *)ent) - h2ctx->dyntab + hpack_entrySize(ent) + 7) & ~7;
+}
+
+
+/*
+ * Link a filled in entry as the head of the dynamic table.
+ * The caller has already made room for the entry.
+ */
+static void hpack_linkEntry(h2_context_t * h2ctx, h2_entry_t * ent, int hdrlen, int vallen) {
     ent->next = h2ctx->head;
     ent->prev = NULL;
     if (h2ctx->head) {
@@ -541,12 +4529,278 @@ int hpack_pushDynamic(h2_context_t * h2ctx, const char * hdr, const char * value
     }
     ent->hdrlen = hdrlen;
     ent->valuelen = vallen;
-    strcpy(ent->hdr, hdr);
-    strcpy(ent->hdr+hdrlen+1, value);
     h2ctx->head = ent;
-    h2ctx->used_size += entlen;
+    h2ctx->used_size += 32+hdrlen+vallen;
     h2ctx->entries++;
-    return 62;
+    h2ctx->inserts++;
+}
+
+
+/*
+ * Find free space for a new entry without evicting any entries.
+ *
+ * The live entries are always a contiguous range of the table which can wrap, so
+ * the free space is after the head entry and before the tail entry.  As with
+ * hpack_insertDynamic the new entry is put after the head or at the start of the
+ * table.
+ *
+ * @param need  The number of bytes needed including the entry header
+ * @return The location for the entry or NULL if there is no space
+ */
+static h2_entry_t * hpack_reserveDynamic(h2_context_t * h2ctx, int need) {
+    int where;
+    int tailoff;
+
+    if (!h2ctx->head)
+        return need <= (int)h2ctx->alloc_size ? (h2_entry_t *)h2ctx->dyntab : NULL;
+    where = hpack_nextWhere(h2ctx);
+    tailoff = (char *)h2ctx->tail - h2ctx->dyntab;
+    if (tailoff < where) {
+        if (where + need <= (int)h2ctx->alloc_size)
+            return (h2_entry_t *)(h2ctx->dyntab + where);
+        if (need <= tailoff)
+            return (h2_entry_t *)h2ctx->dyntab;
+    } else if (where + need <= tailoff) {
+        return (h2_entry_t *)(h2ctx->dyntab + where);
+    }
+    return NULL;
+}
+
+
+/*
+ * Get a dynamic table entry by index
+ */
+static h2_entry_t * hpack_getEntry(h2_context_t * h2ctx, uint32_t inx) {
+    h2_entry_t * ent = h2ctx->head;
+    while (ent && inx > 62) {
+        ent = ent->next;
+        inx--;
+    }
+    return ent;
+}
+
+
+/*
+ * Get the location and length of a string literal without decoding it
+ * @param sbuf  The source buffer positioned at the string literal
+ * @param str   The location of the literal in the source (output)
+ * @param huff  Set if the literal is huffman encoded (output)
+ * @return The length of the literal in the source or a negative error
+ */
+static int hpack_getLiteral(h2_buffer_t * sbuf, const char * * str, int * huff) {
+    uint32_t slen;
+    int      upper;
+    int      rc;
+
+    rc = h2_hpack_getInt(sbuf, &slen, 7, &upper);
+    if (rc < 0)
+        return rc;
+    if (slen > (uint32_t)(sbuf->used - sbuf->pos))
+        return H2ERR_LENGTH;
+    *str = sbuf->buf + sbuf->pos;
+    *huff = upper & 0x80;
+    sbuf->pos += slen;
+    return slen;
+}
+
+
+/*
+ * Check the character classes found in a name or value.
+ * A colon is only allowed as the first character of a name.
+ * @return 0 if the string is valid, or a negative error
+ */
+static int hpack_checkClass(int cls, const char * str, int len) {
+    if (cls & H2CHAR_VALUEBAD)
+        return H2ERR_VALUECHAR;
+    if (cls & H2CHAR_NAMEBAD)
+        return H2ERR_NAMECHAR;
+    if (cls & H2CHAR_UPPER)
+        return H2ERR_NAMEUPPER;
+    if ((cls & H2CHAR_COLON) && (*str != ':' || memchr(str+1, ':', len-1)))
+        return H2ERR_NAMECHAR;
+    return 0;
+}
+
+
+/*
+ * Copy or huffman decode a literal to a location with room for len*8/5+1 bytes.
+ * If mask is set the string is checked for the character classes H2CHAR_* in it.
+ * @return The length of the string or a negative error
+ */
+static int hpack_putLiteral(char * out, const char * str, int len, int huff, int mask) {
+    int cls = 0;
+    if (huff) {
+        if (mask)
+            len = h2_huf2strClass(str, len, out, len*8/5 + 1, &cls);
+        else
+            len = h2_huf2str(str, len, out, len*8/5 + 1);
+        if (len < 0)
+            return H2ERR_HUFFMAN;
+    } else {
+        memcpy(out, str, len);
+        out[len] = 0;
+        if (mask)
+            cls = h2_strClass(out, len, mask);
+    }
+    if ((cls & mask) && (cls = hpack_checkClass(cls & mask, out, len)) < 0)
+        return cls;
+    return len;
+}
+
+
+/*
+ * Decode a literal with incremental indexing directly into the dynamic table.
+ *
+ * The new entry is built in the free space of the table, and only after that are
+ * the old entries evicted and the entry linked in.  The name and value are therefore
+ * copied or huffman decoded only once, and the name can still be taken from an entry
+ * which is evicted by this insert.  If there is not enough free space for the longest
+ * possible decoded value, the literal is decoded into a work buffer and the table is
+ * compacted if required.
+ *
+ * @param h2ctx  The hpack context
+ * @param sbuf   The source positioned at the name or value literal
+ * @param index  The index of the name or 0 for a literal name
+ * @param hdr    The name which is valid until the next insert (output)
+ * @param hdrlen The length of the name (output)
+ * @param value  The value which is valid until the next insert (output)
+ * @param vallen The length of the value (output)
+ * @param tofree A work buffer which the caller must free after using the value (output)
+ * @param raw    The huffman encoded value in the source (output)
+ * @param rawlen The length of the huffman encoded value or 0 if it is not huffman encoded (output)
+ * @return The header ID of the name or a negative error
+ */
+static int hpack_decodeInsert(h2_context_t * h2ctx, h2_buffer_t * sbuf, uint32_t index,
+        const char * * hdr, int * hdrlen, const char * * value, int * vallen, char * * tofree,
+        const char * * raw, int * rawlen) {
+    const char * nstr = NULL;
+    const char * vstr;
+    int  nlen = 0;
+    int  vlen;
+    int  nhuff = 0;
+    int  vhuff;
+    int  need;
+    int  namebytes;
+    int  entlen;
+    char * out;
+    char * valout;
+    h2_entry_t * ent;
+    h2_newname_t nn;
+    int  check = (h2ctx->decode_opt & H2DECODE_VALIDATE) ? H2CHAR_NAME | H2CHAR_VALUE : 0;
+
+    if (index) {
+        if (index < 62) {
+            hpack_resolveName(&nn, NULL, 0, index, NULL);
+        } else {
+            h2_entry_t * nent = hpack_getEntry(h2ctx, index);
+            if (!nent)
+                return H2ERR_INDEX;
+            nstr = hpack_entryName(nent);
+            nlen = nent->hdrlen;
+            hpack_resolveName(&nn, nstr, nlen, -1, nent);
+        }
+    } else {
+        nlen = hpack_getLiteral(sbuf, &nstr, &nhuff);
+        if (nlen < 0)
+            return nlen;
+        hpack_resolveName(&nn, NULL, 0, 0, NULL);
+    }
+    vlen = hpack_getLiteral(sbuf, &vstr, &vhuff);
+    if (vlen < 0) {
+        if (nn.type == H2NAME_SHARED)
+            hpack_releaseName(nn.shared);
+        return vlen;
+    }
+    *raw = vstr;
+    *rawlen = vhuff ? vlen : 0;
+
+    /* Find space for the longest possible result, or use a work buffer */
+    if (nn.type == H2NAME_INLINE)
+        namebytes = (nhuff ? nlen*8/5 : nlen) + 1;
+    else
+        namebytes = hpack_nameBytes(nn.type, nn.len);
+    need = namebytes + (vhuff ? vlen*8/5 : vlen) + 1;
+    ent = hpack_reserveDynamic(h2ctx, offsetof(h2_entry_t, hdr) + need);
+    if (ent) {
+        out = ent->hdr;
+    } else {
+        out = *tofree = malloc(need);
+        if (!out) {
+            if (nn.type == H2NAME_SHARED)
+                hpack_releaseName(nn.shared);
+            return H2ERR_ALLOC;
+        }
+    }
+
+    /* Put the name part and then the value.  A literal name is resolved once it is decoded */
+    if (nn.type == H2NAME_INLINE) {
+        nn.len = hpack_putLiteral(out, nstr, nlen, nhuff, check & H2CHAR_NAME);
+        if (nn.len < 0)
+            return nn.len;
+        nn.name = out;
+        if (!index)
+            hpack_resolveName(&nn, out, nn.len, -1, NULL);
+    }
+    if (nn.type == H2NAME_SHARED)
+        memcpy(out, &nn.shared, sizeof(h2_name_t *));
+    valout = out + hpack_nameBytes(nn.type, nn.len);
+    *vallen = hpack_putLiteral(valout, vstr, vlen, vhuff, check & H2CHAR_VALUE);
+    if (*vallen < 0) {
+        if (nn.type == H2NAME_SHARED)
+            hpack_releaseName(nn.shared);
+        return *vallen;
+    }
+    *hdr = nn.name;
+    *hdrlen = nn.len;
+    *value = valout;
+
+    /* An entry larger than the table empties the table and is not added */
+    entlen = 32 + *hdrlen + *vallen;
+    if (entlen > (int)h2ctx->current_size) {
+        hpack_reduceDynamic(h2ctx, h2ctx->current_size+1);
+        if (nn.type == H2NAME_SHARED) {
+            /* Keep a copy of the name and value for the output as the name is released */
+            char * copy = malloc(*hdrlen + *vallen + 2);
+            if (copy) {
+                memcpy(copy, *hdr, *hdrlen + 1);
+                memcpy(copy + *hdrlen + 1, *value, *vallen + 1);
+                *hdr = copy;
+                *value = copy + *hdrlen + 1;
+            }
+            if (*tofree)
+                free(*tofree);
+            *tofree = copy;
+            hpack_releaseName(nn.shared);
+            if (!copy)
+                return H2ERR_ALLOC;
+        }
+        return nn.inx;
+    }
+    hpack_reduceDynamic(h2ctx, entlen);
+
+    /* Copy the work buffer into the table, compacting the table if there is no space */
+    if (!ent) {
+        need = offsetof(h2_entry_t, hdr) + (int)(valout - out) + *vallen + 1;
+        ent = hpack_reserveDynamic(h2ctx, need);
+        if (!ent) {
+            int rc = hpack_resizeTable(h2ctx, h2ctx->alloc_size);
+            if (rc == 0)
+                ent = hpack_reserveDynamic(h2ctx, need);
+            if (!ent) {
+                if (nn.type == H2NAME_SHARED)
+                    hpack_releaseName(nn.shared);
+                return rc < 0 ? rc : H2ERR_ENTRYSIZE;
+            }
+        }
+        memcpy(ent->hdr, out, need - offsetof(h2_entry_t, hdr));
+        if (nn.type == H2NAME_INLINE)
+            *hdr = ent->hdr;
+        *value = ent->hdr + (valout - out);
+    }
+    ent->nametype = nn.type;
+    ent->nameinx = nn.inx;
+    hpack_linkEntry(h2ctx, ent, *hdrlen, *vallen);
+    return nn.inx;
 }
 
 
@@ -557,24 +4811,62 @@ int hpack_pushDynamic(h2_context_t * h2ctx, const char * hdr, const char * value
  * looking and if there is no exact match we return the name match.
  */
 int hpack_lookupDynamic(h2_context_t * h2ctx, const char * hdr, const char * value) {
+    int hdrlen = (int)strlen(hdr);
+    return hpack_findDynamic(h2ctx, hdr, hdrlen, value, (int)strlen(value), hpack_nameId(hdr, hdrlen, 0), NULL);
+}
+
+
+/*
+ * Find a header in the dynamic table.
+ *
+ * Names are compared by header ID or by shared name where possible.  Only entries
+ * without a header ID need the name bytes compared, as the name can have been given
+ * an ID after the entry was added.
+ *
+ * @param id      The header ID of the name or 0
+ * @param nament  The newest entry with a matching name (output, can be NULL)
+ * @return The index with NOLITERAL for a full match, the index of a name match, or 0
+ */
+static int hpack_findDynamic(h2_context_t * h2ctx, const char * hdr, int hdrlen, const char * value,
+        int vallen, int id, h2_entry_t * * nament) {
     int partial = 0;
     h2_entry_t * ent;
-    int hdrlen;
+    h2_name_t * shared = NULL;
+    h2_name_t * entname;
     int which;
 
-    if (!h2ctx->head)
-        return 0;
-
-    hdrlen = (int)strlen(hdr);
     ent = h2ctx->head;
     which = 62;
     while (ent) {
         if (hdrlen == ent->hdrlen) {
-            if (!memcmp(hdr, ent->hdr, hdrlen)) {
+            int match;
+            switch (id && ent->nameinx ? -1 : ent->nametype) {
+            case -1:
+                match = ent->nameinx == id;
+                break;
+            case H2NAME_STATIC:
+                match = !memcmp(hdr, h2_static[ent->nameinx], hdrlen);
+                break;
+            case H2NAME_SHARED:
+                entname = hpack_entryShared(ent);
+                if (entname == shared) {
+                    match = 1;
+                } else {
+                    match = !memcmp(hdr, entname->name, hdrlen);
+                    if (match)
+                        shared = entname;
+                }
+                break;
+            default:
+                match = !memcmp(hdr, ent->hdr, hdrlen);
+            }
+            if (match) {
                 if (!partial) {
                     partial = which;
+                    if (nament)
+                        *nament = ent;
                 }
-                if (!strcmp(ent->hdr+hdrlen+1, value)) {
+                if (vallen == ent->valuelen && !memcmp(hpack_entryValue(ent), value, vallen)) {
                     return which|NOLITERAL;
                 }
             }
@@ -590,78 +4882,210 @@ int hpack_lookupDynamic(h2_context_t * h2ctx, const char * hdr, const char * val
  * Lookup in the static table
  */
 int hpack_lookupStatic(const char * hdr, const char * value) {
+    return hpack_lookupStaticLen(hdr, (int)strlen(hdr), value, (int)strlen(value));
+}
+
+
+/*
+ * Lookup in the static table using the perfect hash from h2static.h.
+ *
+ * The name is found with one hash and one compare, and for the names which have values
+ * in the static table the name and value are found with one more hash and compare.
+ * The return is the same as hpack_lookupStatic.
+ */
+int hpack_lookupStaticLen(const char * hdr, int hdrlen, const char * value, int vallen) {
     int idx;
-    switch (*hdr) {
-    case ':':  idx = 1;    break;
-    case 'a':  idx = 15;   break;
-    case 'c':  idx = 24;   break;
-    case 'd':  idx = 33;   break;
-    case 'e':  idx = 34;   break;
-    case 'f':  idx = 37;   break;
-    case 'h':  idx = 38;   break;
-    case 'i':  idx = 39;   break;
-    case 'l':  idx = 44;   break;
-    case 'm':  idx = 47;   break;
-    case 'p':  idx = 48;   break;
-    case 'r':  idx = 50;   break;
-    case 's':  idx = 54;   break;
-    case 't':  idx = 57;   break;
-    case 'u':  idx = 58;   break;
-    case 'v':  idx = 59;   break;
-    case 'w':  idx = 61;   break;
-    default:   return 0;
-    };
-    while (*h2_static[idx] == *hdr) {
-        if (!strcmp(h2_static[idx], hdr)) {
-            if (idx <= 16) {
-                switch (idx) {
-                case 2:  /* :method */
-                    if (!strcmp(value, "GET"))
-                        return NOLITERAL + 2;
-                    if (!strcmp(value, "POST"))
-                        return NOLITERAL + 3;
-                    break;
-                case 4:  /* :path */
-                    if (!strcmp(value, "/"))
-                        return NOLITERAL + 4;
-                    if (!strcmp(value, "/index.html"))
-                        return NOLITERAL + 5;
-                    break;
-                case 6:  /* :scheme */
-                    if (!strcmp(value, "http"))
-                        return NOLITERAL + 6;
-                    if (!strcmp(value, "https"))
-                        return NOLITERAL + 7;
-                    break;
-                case 8:  /* :status */
-                    if (!strcmp(value, "200"))
-                        return NOLITERAL + 8;
-                    if (!strcmp(value, "204"))
-                        return NOLITERAL + 9;
-                    if (!strcmp(value, "206"))
-                        return NOLITERAL + 10;
-                    if (!strcmp(value, "304"))
-                        return NOLITERAL + 11;
-                    if (!strcmp(value, "400"))
-                        return NOLITERAL + 12;
-                    if (!strcmp(value, "404"))
-                        return NOLITERAL + 13;
-                    if (!strcmp(value, "500"))
-                        return NOLITERAL + 14;
-                    break;
-                case 16:
-                    if (!strcmp(value, "gzip, deflate"))
-                        return NOLITERAL + 16;
-                    break;
-                default:
-                    break;
-                }
-            }
-            return idx;
+    int pidx;
+
+    if (hdrlen < 1)
+        return 0;
+    idx = h2s_names[H2S_NAMEHASH(hdr, hdrlen)];
+    if (!idx || h2s_namelen[idx] != hdrlen || memcmp(h2_static[idx], hdr, hdrlen))
+        return 0;
+    if (idx <= 16 && vallen > 0) {
+        pidx = h2s_pairs[H2S_PAIRHASH(idx, value, vallen)];
+        if (pidx && h2s_first[pidx] == idx && h2s_vallen[pidx] == vallen &&
+                !memcmp(h2_static_val[pidx], value, vallen)) {
+            return NOLITERAL + pidx;
         }
-        idx++;
     }
-    return 0;
+    return idx;
+}
+
+
+/*
+ * Hash a name for the extra header ID table and the interned name pool
+ */
+static uint32_t hpack_nameHash(const char * name, int len) {
+    uint32_t hash = 2166136261U;
+    int i;
+    for (i=0; i<len; i++)
+        hash = (hash ^ (uint8_t)name[i]) * 16777619;
+    return hash ^ (hash >> 16);
+}
+
+
+/*
+ * Set the extra well known header names.
+ * A dynamic table entry matches a name by its ID, so the names cannot be changed
+ * while any context exists.  The governor lock keeps a context from being created
+ * while the list is rewritten.
+ */
+int hpack_setHeaderIds(const char * const * names, int count) {
+    int i;
+    int set = 0;
+
+    if (count < 0 || count > H2ID_MAXEXTRA)
+        return -1;
+    h2_lock(&h2_gov.lock);
+    if (h2_gov.contexts) {
+        h2_unlock(&h2_gov.lock);
+        return -1;
+    }
+    for (i=0; i<H2ID_MAXEXTRA; i++) {
+        if (h2_extra.names[i])
+            free(h2_extra.names[i]);
+        h2_extra.names[i] = NULL;
+        h2_extra.lens[i] = 0;
+    }
+    memset(h2_extra.slot, 0, sizeof h2_extra.slot);
+    h2_extra.count = 0;
+
+    for (i=0; i<count; i++) {
+        int len = (int)strlen(names[i]);
+        int slot;
+        if (len < 1 || hpack_lookupStaticLen(names[i], len, "", 0))
+            continue;
+        h2_extra.names[i] = malloc(len + 1);
+        if (!h2_extra.names[i])
+            break;
+        memcpy(h2_extra.names[i], names[i], len + 1);
+        h2_extra.lens[i] = (uint16_t)len;
+        slot = hpack_nameHash(names[i], len) & (H2ID_HASHSIZE-1);
+        while (h2_extra.slot[slot])
+            slot = (slot + 1) & (H2ID_HASHSIZE-1);
+        h2_extra.slot[slot] = (uint8_t)(i + 1);
+        set++;
+    }
+    h2_extra.count = set;
+    h2_unlock(&h2_gov.lock);
+    return set;
+}
+
+
+/*
+ * Get the header ID of a name.
+ *
+ * The static table, the extra names, and then the interned names are checked.  If
+ * observe is set and the name has no ID, it is counted and is interned when it has
+ * been seen often enough.  Only the encoder observes names.
+ */
+static int hpack_nameId(const char * name, int len, int observe) {
+    uint32_t hash;
+    int inx;
+    int slot;
+
+    inx = hpack_lookupStaticLen(name, len, "", 0);
+    if (inx || len < 1)
+        return inx;
+    hash = hpack_nameHash(name, len);
+    if (h2_extra.count) {
+        slot = hash & (H2ID_HASHSIZE-1);
+        while ((inx = h2_extra.slot[slot])) {
+            inx--;
+            if (h2_extra.lens[inx] == len && !memcmp(h2_extra.names[inx], name, len))
+                return H2ID_EXTRA + inx;
+            slot = (slot + 1) & (H2ID_HASHSIZE-1);
+        }
+    }
+    slot = (hash >> 8) & (H2INTERN_HASHSIZE-1);
+    while ((inx = h2_load_acquire(&h2_intern.slot[slot]))) {
+        h2_name_t * nm = h2_intern.names[inx-1];
+        if (nm->len == len && !memcmp(nm->name, name, len))
+            return H2ID_INTERN + inx - 1;
+        slot = (slot + 1) & (H2INTERN_HASHSIZE-1);
+    }
+
+    /* Count the name and intern it when it is seen often enough */
+    if (observe && len >= H2NAME_MINSHARE && len <= H2INTERN_MAXLEN && h2_intern.threshold &&
+            h2_intern.count < H2ID_MAXINTERN) {
+        volatile uint16_t * seen = h2_intern.seen + (hash >> 16) % H2INTERN_COUNTERS;
+        if (h2_atomic_inc16(seen) >= h2_intern.threshold) {
+            h2_store_release(seen, 0);
+            return hpack_internName(name, len);
+        }
+    }
+    return H2ID_UNKNOWN;
+}
+
+
+/*
+ * Get the well known header ID of a name
+ */
+int hpack_getHeaderId(const char * name, int len) {
+    return hpack_nameId(name, len, 0);
+}
+
+
+/*
+ * Get the name for a well known header ID
+ */
+const char * hpack_getHeaderName(int id) {
+    if (id > 0 && id < 62 && h2s_first[id] == id)
+        return h2_static[id];
+    if (id >= H2ID_EXTRA && id < H2ID_EXTRA + H2ID_MAXEXTRA)
+        return h2_extra.names[id - H2ID_EXTRA];
+    if (id >= H2ID_INTERN && id - H2ID_INTERN < h2_load_acquire(&h2_intern.count))
+        return h2_intern.names[id - H2ID_INTERN]->name;
+    return NULL;
+}
+
+
+/*
+ * Add a name to the interned name pool
+ */
+int hpack_internName(const char * name, int len) {
+    h2_name_t * nm;
+    int id;
+    int inx;
+    int slot;
+
+    if (len < 1 || len > H2INTERN_MAXLEN)
+        return H2ID_UNKNOWN;
+    id = hpack_nameId(name, len, 0);
+    if (id)
+        return id;
+
+    h2_lock(&h2_intern.lock);
+    /* Check again as another thread might have added the name */
+    id = hpack_nameId(name, len, 0);
+    inx = h2_intern.count;
+    if (!id && inx < H2ID_MAXINTERN) {
+        nm = malloc(offsetof(h2_name_t, name) + len + 1);
+        if (nm) {
+            nm->refs = H2NAME_INTERNED;
+            nm->len = (uint16_t)len;
+            memcpy(nm->name, name, len);
+            nm->name[len] = 0;
+            h2_intern.names[inx] = nm;
+            slot = (hpack_nameHash(name, len) >> 8) & (H2INTERN_HASHSIZE-1);
+            while (h2_intern.slot[slot])
+                slot = (slot + 1) & (H2INTERN_HASHSIZE-1);
+            h2_store_release(&h2_intern.slot[slot], (uint8_t)(inx + 1));
+            h2_store_release(&h2_intern.count, inx + 1);
+            id = H2ID_INTERN + inx;
+        }
+    }
+    h2_unlock(&h2_intern.lock);
+    return id;
+}
+
+
+/*
+ * Set the number of times a name is seen before it is interned
+ */
+void hpack_setInternThreshold(int count) {
+    h2_intern.threshold = count > 0xffff ? 0xffff : count < 0 ? 0 : count;
 }
 
 
@@ -670,14 +5094,19 @@ int hpack_lookupStatic(const char * hdr, const char * value) {
  */
 const char * hpack_getHeader(h2_context_t * h2ctx, int inx) {
     if (inx < 62) {
+        if (inx < 1)
+            return NULL;
         return h2_static[inx];
     } else {
         int where = 62;
         h2_entry_t * ent = h2ctx->head;
         while (ent && where < inx) {
             ent = ent->next;
+            where++;
         }
-        return (const char *)ent->hdr;
+        if (!ent)
+            return NULL;
+        return hpack_entryName(ent);
     }
     return NULL;
 }
@@ -698,8 +5127,11 @@ const char * hpack_getValue(h2_context_t * h2ctx, int inx) {
         h2_entry_t * ent = h2ctx->head;
         while (ent && where < inx) {
             ent = ent->next;
+            where++;
         }
-        return (const char *)(ent->hdr + ent->hdrlen + 1);
+        if (!ent)
+            return NULL;
+        return hpack_entryValue(ent);
     }
 }
 
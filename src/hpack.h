@@ -0,0 +1,897 @@
+#ifndef __HPACK_DEFINED
+#define __HPACK_DEFINED
+
+/* These interfaces are defined in C */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "h2utils.h"
+
+/*
+ * The hpack context and header template are opaque to the user
+ */
+typedef struct h2_context_t h2_context_t;
+typedef struct h2_template_t h2_template_t;
+
+/*
+ * Encoder options
+ */
+#define H2ENCODE_NONE    0       /**< Use only literals                            */
+#define H2ENCODE_STATIC  1       /**< Use the static table only                    */
+#define H2ENCODE_MIN     2       /**< Add to the dynamic table only if there is space */
+#define H2ENCODE_MAX     3       /**< Add to the dynamic table evicting as required */
+
+/*
+ * Decoder options
+ */
+#define H2DECODE_NOSPACE 0       /**< Output "name:value"                          */
+#define H2DECODE_SPACE   1       /**< Output "name: value"                         */
+#define H2DECODE_RAWHUFF 0x10    /**< Keep the huffman bytes of literal values in fields */
+#define H2DECODE_LAZY    0x20    /**< Leave huffman literal values in the source for hpack_refValue */
+#define H2DECODE_VALIDATE 0x40   /**< Reject invalid characters in literal names and values */
+
+/*
+ * Decoder error codes.
+ * With the H2DECODE_VALIDATE option a literal name or value which RFC 9113 does not
+ * allow is rejected with H2ERR_NAMEUPPER, H2ERR_NAMECHAR or H2ERR_VALUECHAR.  Strings
+ * from the static table, and from the dynamic table as they were checked when they were
+ * added, are not checked again.
+ * H2ERR_ALLOC and H2ERR_ENTRYSIZE are returned when a field cannot be added to the
+ * dynamic table, after the entries it evicts have been removed.  The table is then out
+ * of step with the peer, so the connection must be closed with COMPRESSION_ERROR.
+ * H2ERR_LISTSIZE, H2ERR_FIELDCOUNT and H2ERR_FIELDSIZE are returned as soon as a block
+ * goes over a decode limit, so the rest of the block is not decoded and its changes to
+ * the dynamic table are lost.  The connection must then also be closed, for instance
+ * with ENHANCE_YOUR_CALM, as the peer is sending more than it was allowed.
+ */
+#define H2ERR_TABLESIZE   -10    /**< Table size update larger than the declared size */
+#define H2ERR_TABLEUPDATE -11    /**< Table size update after the first header field  */
+#define H2ERR_INDEX       -12    /**< Index not in the static or dynamic table        */
+#define H2ERR_LENGTH      -13    /**< String literal longer than the header block     */
+#define H2ERR_HUFFMAN     -14    /**< Invalid huffman encoded string                   */
+#define H2ERR_ALLOC       -15    /**< Memory allocation failed                         */
+#define H2ERR_ENTRYSIZE   -16    /**< Table entry does not fit in the allocated table  */
+#define H2ERR_FIELDS      -17    /**< More header fields than the field array holds    */
+#define H2ERR_NAMEUPPER   -18    /**< Uppercase letter in a header name                */
+#define H2ERR_NAMECHAR    -19    /**< Invalid character in a header name               */
+#define H2ERR_VALUECHAR   -20    /**< NUL, CR or LF in a header value                  */
+#define H2ERR_LISTSIZE    -21    /**< Header list larger than the decode limit          */
+#define H2ERR_FIELDCOUNT  -22    /**< More header fields than the decode limit          */
+#define H2ERR_FIELDSIZE   -23    /**< Header field larger than the decode limit         */
+#define H2ERR_PSEUDO      -24    /**< Pseudo-header fields do not make an HTTP/1.1 head */
+
+/*
+ * Encoder indexing policy for a header name
+ */
+#define H2POLICY_INDEX   0       /**< Add to the dynamic table as allowed by the encoder options */
+#define H2POLICY_NOINDEX 1       /**< Use the dynamic table but do not add to it    */
+#define H2POLICY_NEVER   2       /**< Send as a literal never indexed               */
+#define H2POLICY_STATIC  3       /**< Use only the static table                     */
+
+/*
+ * Flag returned by table lookup when both the name and value match
+ */
+#define NOLITERAL        0x1000000
+
+/*
+ * Well known header IDs.
+ * A header name in the static table has the ID of the first static table index with
+ * that name.  Extra names set by hpack_setHeaderIds have IDs starting at H2ID_EXTRA,
+ * and names in the interned name pool have IDs starting at H2ID_INTERN.
+ */
+#define H2ID_UNKNOWN                        0    /**< Not a well known header       */
+#define H2ID_AUTHORITY                      1    /**< :authority                    */
+#define H2ID_METHOD                         2    /**< :method                       */
+#define H2ID_PATH                           4    /**< :path                         */
+#define H2ID_SCHEME                         6    /**< :scheme                       */
+#define H2ID_STATUS                         8    /**< :status                       */
+#define H2ID_ACCEPT_CHARSET                15    /**< accept-charset                */
+#define H2ID_ACCEPT_ENCODING               16    /**< accept-encoding               */
+#define H2ID_ACCEPT_LANGUAGE               17    /**< accept-language               */
+#define H2ID_ACCEPT_RANGES                 18    /**< accept-ranges                 */
+#define H2ID_ACCEPT                        19    /**< accept                        */
+#define H2ID_ACCESS_CONTROL_ALLOW_ORIGIN   20    /**< access-control-allow-origin   */
+#define H2ID_AGE                           21    /**< age                           */
+#define H2ID_ALLOW                         22    /**< allow                         */
+#define H2ID_AUTHORIZATION                 23    /**< authorization                 */
+#define H2ID_CACHE_CONTROL                 24    /**< cache-control                 */
+#define H2ID_CONTENT_DISPOSITION           25    /**< content-disposition           */
+#define H2ID_CONTENT_ENCODING              26    /**< content-encoding              */
+#define H2ID_CONTENT_LANGUAGE              27    /**< content-language              */
+#define H2ID_CONTENT_LENGTH                28    /**< content-length                */
+#define H2ID_CONTENT_LOCATION              29    /**< content-location              */
+#define H2ID_CONTENT_RANGE                 30    /**< content-range                 */
+#define H2ID_CONTENT_TYPE                  31    /**< content-type                  */
+#define H2ID_COOKIE                        32    /**< cookie                        */
+#define H2ID_DATE                          33    /**< date                          */
+#define H2ID_ETAG                          34    /**< etag                          */
+#define H2ID_EXPECT                        35    /**< expect                        */
+#define H2ID_EXPIRES                       36    /**< expires                       */
+#define H2ID_FROM                          37    /**< from                          */
+#define H2ID_HOST                          38    /**< host                          */
+#define H2ID_IF_MATCH                      39    /**< if-match                      */
+#define H2ID_IF_MODIFIED_SINCE             40    /**< if-modified-since             */
+#define H2ID_IF_NONE_MATCH                 41    /**< if-none-match                 */
+#define H2ID_IF_RANGE                      42    /**< if-range                      */
+#define H2ID_IF_UNMODIFIED_SINCE           43    /**< if-unmodified-since           */
+#define H2ID_LAST_MODIFIED                 44    /**< last-modified                 */
+#define H2ID_LINK                          45    /**< link                          */
+#define H2ID_LOCATION                      46    /**< location                      */
+#define H2ID_MAX_FORWARDS                  47    /**< max-forwards                  */
+#define H2ID_PROXY_AUTHENTICATE            48    /**< proxy-authenticate            */
+#define H2ID_PROXY_AUTHORIZATION           49    /**< proxy-authorization           */
+#define H2ID_RANGE                         50    /**< range                         */
+#define H2ID_REFERER                       51    /**< referer                       */
+#define H2ID_REFRESH                       52    /**< refresh                       */
+#define H2ID_RETRY_AFTER                   53    /**< retry-after                   */
+#define H2ID_SERVER                        54    /**< server                        */
+#define H2ID_SET_COOKIE                    55    /**< set-cookie                    */
+#define H2ID_STRICT_TRANSPORT_SECURITY     56    /**< strict-transport-security     */
+#define H2ID_TRANSFER_ENCODING             57    /**< transfer-encoding             */
+#define H2ID_USER_AGENT                    58    /**< user-agent                    */
+#define H2ID_VARY                          59    /**< vary                          */
+#define H2ID_VIA                           60    /**< via                           */
+#define H2ID_WWW_AUTHENTICATE              61    /**< www-authenticate              */
+#define H2ID_EXTRA                         64    /**< The first extra header ID     */
+#define H2ID_MAXEXTRA                      64    /**< The maximum number of extras  */
+#define H2ID_INTERN                       128    /**< The first interned name ID    */
+#define H2ID_MAXINTERN                    128    /**< The maximum interned names    */
+
+/*
+ * A decoded header field.
+ * The name and value are given as offsets into the output buffer as the buffer can be
+ * reallocated as it is filled.  Both are null terminated in the output.  With the
+ * H2DECODE_RAWHUFF option, a value which was sent as a huffman encoded literal also
+ * has the huffman bytes in the output buffer.
+ */
+typedef struct h2_field_t {
+    uint32_t name;               /**< The offset of the name in the output buffer   */
+    uint32_t value;              /**< The offset of the value in the output buffer  */
+    uint32_t vallen;             /**< The length of the value                       */
+    uint16_t namelen;            /**< The length of the name                        */
+    uint16_t id;                 /**< The well known header ID or H2ID_UNKNOWN      */
+    uint32_t raw;                /**< The offset of the huffman encoded value       */
+    uint32_t rawlen;             /**< The length of the huffman value, 0=none       */
+} h2_field_t;
+
+/*
+ * The representation of a decoded header field
+ */
+#define H2REP_INDEXED     0      /**< Indexed field                                 */
+#define H2REP_INCREMENTAL 1      /**< Literal with incremental indexing             */
+#define H2REP_NOINDEX     2      /**< Literal without indexing                      */
+#define H2REP_NEVER       3      /**< Literal never indexed                         */
+
+/*
+ * Where the name and value of a field reference are.
+ * A string with none of these flags is in the static table.
+ */
+#define H2FIELD_NAMESRC   0x01   /**< The name is in the source header block        */
+#define H2FIELD_NAMEBUF   0x02   /**< The name is in the output buffer or arena     */
+#define H2FIELD_NAMETABLE 0x04   /**< The name is in the dynamic table              */
+#define H2FIELD_VALSRC    0x10   /**< The value is in the source header block       */
+#define H2FIELD_VALBUF    0x20   /**< The value is in the output buffer or arena    */
+#define H2FIELD_VALTABLE  0x40   /**< The value is in the dynamic table             */
+#define H2FIELD_VALHUFF   0x80   /**< The value in the source is huffman encoded    */
+
+/*
+ * A decoded header field which references its name and value where they already are.
+ * Only a name or value which is in the output buffer or arena is null terminated.
+ */
+typedef struct h2_fieldref_t {
+    const char * name;           /**< The name                                      */
+    const char * value;          /**< The value                                     */
+    uint32_t namelen;            /**< The length of the name                        */
+    uint32_t vallen;             /**< The length of the value                       */
+    uint16_t id;                 /**< The well known header ID or H2ID_UNKNOWN      */
+    uint8_t  rep;                /**< The representation H2REP_*                    */
+    uint8_t  flags;              /**< Where the name and value are H2FIELD_*        */
+    uint32_t maxlen;             /**< The largest value left in the source allowed by the decode limits */
+} h2_fieldref_t;
+
+/*
+ * Create a new h2 context
+ * @param  size      The size of the dynamic table
+ * @param  encode    Use of context 0=decode, 1=encode
+ * @param  maxentry  The size of the largest entry allowed
+ * @param  options   The encoder or decoder options
+ * @param  huf       Use huffman encoding
+ */
+XAPI h2_context_t * hpack_newContext(int size, int encode, int maxentry, int options, int huff);
+
+/*
+ * Free the hpack context
+ * @param h2ctx  The hpack context
+ */
+XAPI void hpack_freeContext(h2_context_t * h2ctx);
+
+/*
+ * Get the sizes of the hpack context
+ * @param h2ctx   The hpack context
+ * @param maxsize The max size of the dynamic table (output)
+ * @param currentsize The current size of the dynamic table (output)
+ * @param usedsize The number of bytes actually used in the dynamic table (output)
+ * @param return The number of entries in the dynamic table
+ */
+XAPI int hpack_getContextStats(h2_context_t * h2ctx, int * maxsize, int * currentsize, int * usedsize);
+
+/*
+ * Set the encoder indexing policy for a header name.
+ *
+ * The default policy sends authorization and proxy-authorization as literals never
+ * indexed, and does not add date, content-length, x-request-id, traceparent,
+ * x-b3-traceid and x-b3-spanid to the dynamic table.  Other names use H2POLICY_INDEX.
+ * A name which is not in the static table is interned to give it a header ID.
+ *
+ * @param h2ctx   The hpack encoder context, or NULL to set the default for new contexts
+ *                and contexts which have not set their own policy
+ * @param name    The lower case header name
+ * @param policy  The policy H2POLICY_*
+ * @return 0=good, -1 if the policy or context is not valid or the name cannot be interned
+ */
+XAPI int hpack_setPolicy(h2_context_t * h2ctx, const char * name, int policy);
+
+/*
+ * Get the encoder indexing policy for a header name
+ * @param h2ctx   The hpack encoder context, or NULL for the default policy
+ * @param name    The lower case header name
+ * @return The policy H2POLICY_*
+ */
+XAPI int hpack_getPolicy(h2_context_t * h2ctx, const char * name);
+
+/*
+ * Change the current size of the encoder dynamic table.
+ *
+ * This can be used to reduce the memory used by the table without changing
+ * SETTINGS_HEADER_TABLE_SIZE, and to grow it again up to the declared size.  The
+ * table is changed immediately and the dynamic table size update is written at the
+ * start of the next header block encoded with hpack_encode.
+ *
+ * @param h2ctx  The hpack encoder context
+ * @param size   The new size of the dynamic table
+ * @return 0=good, -1 if the size is larger than the declared size or the context
+ *         is not an encoder
+ */
+XAPI int hpack_setTableSize(h2_context_t * h2ctx, int size);
+
+/*
+ * Set the limits for decoding a header block.
+ *
+ * A header block which goes over a limit is rejected as soon as it is known to, before
+ * the field which goes over is copied or decoded.  An indexed field is checked with the
+ * lengths in the table, and a literal is checked with the shortest string its encoded
+ * length can decode to before it is decoded and again with its decoded length.  The
+ * header list size is that of SETTINGS_MAX_HEADER_LIST_SIZE, the sum of the name and
+ * value lengths plus 32 for each field.  A value which is left in the source by the
+ * H2DECODE_LAZY option is counted with the shortest length it can decode to.
+ *
+ * As with other decode errors the context can not be used after a limit is exceeded,
+ * as the rest of the block has not been applied to the dynamic table.  The connection
+ * must be closed, and the limits are not a way to reject a single stream.
+ *
+ * @param h2ctx      The hpack decoder context
+ * @param maxlist    The largest header list size, 0=no limit
+ * @param maxfields  The most fields in a header block, 0=no limit
+ * @param maxfield   The largest name plus value length of a field, 0=no limit
+ * @return 0=good, -1 if the context is not a decoder or a limit is negative
+ */
+XAPI int hpack_setDecodeLimits(h2_context_t * h2ctx, int maxlist, int maxfields, int maxfield);
+
+/*
+ * Memory used by the dynamic tables of all contexts
+ */
+typedef struct h2_memory_t {
+    uint64_t budget;             /**< The memory budget, 0=no budget               */
+    uint64_t used;               /**< The bytes allocated for encoder tables        */
+    uint64_t projected;          /**< The encoder bytes once requests are applied   */
+    uint64_t decoders;           /**< The bytes allocated for decoder tables        */
+    uint32_t contexts;           /**< The number of contexts                        */
+    uint32_t shrinks;            /**< The number of table reductions                */
+    uint32_t grows;              /**< The number of table increases                 */
+    uint32_t interned;           /**< The number of names in the interned name pool */
+} h2_memory_t;
+
+/*
+ * Set the process wide memory budget for dynamic tables.
+ *
+ * The memory allocated for the encoder dynamic tables is tracked.  When it exceeds
+ * the budget, the encoder tables which have been idle the longest or have the lowest
+ * hit rate are reduced using dynamic table size updates.  A table which is not being
+ * encoded is reduced and its memory released immediately, and the size update is sent
+ * at the start of its next header block.  A table which is in use is reduced by the
+ * encoder at the start of its next header block.  Decoder tables are outside the
+ * budget as their size is set by the peer, and their memory is reported separately.
+ *
+ * @param budget  The number of bytes allowed for encoder tables, 0=no budget
+ * @return The number of table size changes
+ */
+XAPI int hpack_setMemoryBudget(uint64_t budget);
+
+/*
+ * Check the memory budget.
+ *
+ * This should be called periodically (for instance once a second).  The idle time
+ * of a context is measured in calls to this function.  Tables which were reduced
+ * are allowed to grow again when the usage falls below three quarters of the budget,
+ * up to the size last set with hpack_setTableSize.
+ *
+ * @return The number of table size changes
+ */
+XAPI int hpack_governorCheck(void);
+
+/*
+ * Get the memory used by the dynamic tables of all contexts
+ * @param usage  The memory usage (output)
+ */
+XAPI void hpack_getMemoryUsage(h2_memory_t * usage);
+
+/*
+ * Encoder load levels
+ */
+#define H2LOAD_FULL      0       /**< Use the encoder options of each context      */
+#define H2LOAD_NOHUFF    1       /**< Do not use huffman encoding                  */
+#define H2LOAD_STATIC    2       /**< Do not use huffman or the dynamic table      */
+
+/*
+ * The state of the encoder load controller
+ */
+typedef struct h2_load_t {
+    uint64_t high;               /**< The load which raises the level, 0=disabled  */
+    uint64_t low;                /**< The load which lowers the level              */
+    uint64_t encode_ns;          /**< Nanoseconds spent encoding header blocks     */
+    uint32_t level;              /**< The current load level H2LOAD_*              */
+    uint32_t changes;            /**< The number of level changes                  */
+} h2_load_t;
+
+/*
+ * Set the watermarks of the encoder load controller.
+ *
+ * When the load given to hpack_loadCheck is above the high watermark, all encoders
+ * are moved to a cheaper level: first huffman encoding is stopped, and then the
+ * dynamic table is no longer used.  When the load is below the low watermark, they
+ * are moved back one level.  An encoder changes level at the start of its next header
+ * block.  The entries already in the dynamic table are kept, so the peer's table is
+ * still the same as the encoder's when the full options are restored.
+ *
+ * While the controller is enabled the time spent in each encode call is measured and
+ * can be used as the load.
+ *
+ * @param high  The load which moves to a cheaper level, 0=disable the controller
+ * @param low   The load which moves back to a more compressed level
+ */
+XAPI void hpack_setLoadWatermarks(uint64_t high, uint64_t low);
+
+/*
+ * Check the load and change the encoder level.
+ *
+ * This should be called periodically with a load signal, such as the run queue
+ * delay, or the change in encode_ns from hpack_getLoad since the last check.
+ *
+ * @param load  The current load
+ * @return The load level
+ */
+XAPI int hpack_loadCheck(uint64_t load);
+
+/*
+ * Get the state of the encoder load controller
+ * @param load  The state (output)
+ */
+XAPI void hpack_getLoad(h2_load_t * load);
+
+/*
+ * Serialize the state of an hpack context.
+ *
+ * The options, table sizes, indexing policies set on an encoder context, decode
+ * limits and dynamic table entries are written to the buffer in a compact binary
+ * form which can be given to hpack_restoreContext in this or another process.
+ * A policy is kept only where it differs from the process default.
+ *
+ * @param h2ctx  The hpack context
+ * @param buf    The output buffer
+ * @return The number of bytes written or a negative value to indicate an error
+ */
+XAPI int hpack_serializeContext(h2_context_t * h2ctx, h2_buffer_t * buf);
+
+/*
+ * Restore an hpack context from its serialized form.
+ *
+ * @param src   The serialized context
+ * @param slen  The length of the serialized context
+ * @return A new context which must be freed with hpack_freeContext, or NULL if the
+ *         serialized form is not valid
+ */
+XAPI h2_context_t * hpack_restoreContext(const char * src, int slen);
+
+/*
+ * Encode an http/2 header
+ *
+ * @param h2ctx  The http/2 context
+ * @param src    The source header.  This will be modified by this method.
+ * @param slen   The length of the source
+ * @param buf    The output buffer
+ * @return A return code, 0=good
+ */
+XAPI int hpack_encode(h2_context_t * h2ctx, char * src, int slen, h2_buffer_t * buf);
+
+/*
+ * Get the largest size of an encoded header.
+ *
+ * When the output buffer has room for this many bytes the header is encoded without
+ * checking the buffer capacity for each field.  A buffer in the heap is grown to this
+ * size, so to use the fast path with a buffer on the stack it should be at least this
+ * size.
+ *
+ * @param slen  The length of the source header
+ * @return The largest number of bytes in the encoded header block, or -1 if the
+ *         length is too large
+ */
+XAPI int hpack_encodeBound(int slen);
+
+/*
+ * Create a new hpack context with the gRPC profile.
+ *
+ * This is the same as hpack_newContext, but the common gRPC header fields are encoded
+ * when the context is created and are copied into the output when they are used.  The
+ * fields with a fixed value (content-type: application/grpc, te: trailers,
+ * grpc-status: 0, grpc-encoding: identity, grpc-accept-encoding) are added to the
+ * dynamic table the first time they are used and are then indexed without a lookup.
+ * The grpc-message field is not added to the dynamic table.  The gRPC header names
+ * are interned for both encoder and decoder contexts.
+ *
+ * @param  size      The size of the dynamic table
+ * @param  encode    Use of context 0=decode, 1=encode
+ * @param  maxentry  The size of the largest entry allowed
+ * @param  options   The encoder or decoder options
+ * @param  huf       Use huffman encoding
+ */
+XAPI h2_context_t * hpack_newGrpcContext(int size, int encode, int maxentry, int options, int huff);
+
+/*
+ * Encode gRPC trailers.
+ *
+ * This encodes a header block with grpc-status and an optional grpc-message.  For an
+ * encoder with the gRPC profile, a status of 0 is normally a single byte.
+ *
+ * @param h2ctx    The hpack encoder context
+ * @param status   The gRPC status
+ * @param message  The gRPC message or NULL
+ * @param buf      The output buffer
+ * @return A return code, 0=good
+ */
+XAPI int hpack_encodeGrpcStatus(h2_context_t * h2ctx, int status, const char * message, h2_buffer_t * buf);
+
+/*
+ * Create a header template.
+ *
+ * A template is a set of header fields which is sent in many header blocks, such as
+ * the common response headers of a server.  The fields are encoded when the template is
+ * created, and are copied into the output when the template is encoded.  A field which
+ * is added to the dynamic table is then sent as an index for as long as it is in the
+ * table, and the whole encoded template is reused when the dynamic table has not changed
+ * since the last time it was encoded.  The encoding of each field is decided using the
+ * options and indexing policies of the context, and the fields are encoded again when
+ * these change.  A name or value longer than 64K is rejected.
+ *
+ * A template can only be used with the context it was created for, and must be freed
+ * before the context is freed.
+ *
+ * @param h2ctx  The hpack encoder context
+ * @param hdrs   The header fields in the same form as for hpack_encode
+ * @param hdrlen The length of the header fields (or -1 to use a null terminated string)
+ * @return The template or NULL if there is an error
+ */
+XAPI h2_template_t * hpack_newTemplate(h2_context_t * h2ctx, const char * hdrs, int hdrlen);
+
+/*
+ * Encode a header block from a template.
+ *
+ * The template fields are encoded followed by any additional fields.
+ *
+ * @param h2ctx  The hpack encoder context used to create the template
+ * @param tmpl   The template
+ * @param src    Additional header fields or NULL.  This will be modified by this method.
+ * @param slen   The length of the additional header fields
+ * @param buf    The output buffer
+ * @return A return code, 0=good
+ */
+XAPI int hpack_encodeTemplate(h2_context_t * h2ctx, h2_template_t * tmpl, char * src, int slen, h2_buffer_t * buf);
+
+/*
+ * Free a header template
+ * @param tmpl  The template
+ */
+XAPI void hpack_freeTemplate(h2_template_t * tmpl);
+
+/*
+ * Decode an hpack header
+ *
+ * @param h2ctx  The hpack context
+ * @param src    The source compressed header.
+ * @param slen   The length of the source
+ * @param buf    The output buffer
+ * @return A return code, 0=good
+ */
+XAPI int hpack_decode(h2_context_t * h2ctx, const char * src, int slen, h2_buffer_t * buf);
+
+/*
+ * Decode an hpack header into header fields.
+ *
+ * Each field is written to the output buffer as a null terminated name followed by a
+ * null terminated value, and is described by an entry in the field array which
+ * includes its well known header ID.  The ID is known without a string compare when
+ * the name comes from the static table or from a dynamic table entry.
+ *
+ * @param h2ctx     The hpack context
+ * @param src       The source compressed header.
+ * @param slen      The length of the source
+ * @param buf       The output buffer
+ * @param fields    The array of fields (output)
+ * @param maxfields The number of fields in the array
+ * @return The number of fields, or a negative value to indicate an error
+ */
+XAPI int hpack_decodeFields(h2_context_t * h2ctx, const char * src, int slen, h2_buffer_t * buf,
+        h2_field_t * fields, int maxfields);
+
+/*
+ * Decode an hpack header into references to the header fields.
+ *
+ * The name and value of each field point to the static table, to an entry in the
+ * dynamic table, or to the source header block when the literal is not huffman
+ * encoded.  Only huffman encoded literals are decoded into the output buffer, and
+ * as the buffer can be reallocated these pointers are set when the block is complete.
+ * An entry which is evicted by a later field in the same block is copied into the
+ * output buffer before it is evicted.  With the H2DECODE_LAZY option a huffman encoded
+ * value which is not added to the dynamic table is left in the source, and is decoded
+ * by hpack_refValue when it is needed.
+ *
+ * The fields are valid until the next header block is decoded with the context, and
+ * while the source block and the output buffer are not changed.
+ *
+ * When the block has more fields than the array holds, the rest of the block is still
+ * decoded into the dynamic table without output and H2ERR_FIELDS is returned.  The
+ * table is then in step with the peer, so only the stream needs to be reset.  The same
+ * applies to hpack_decodeArena and hpack_decodeRoute.
+ *
+ * @param h2ctx     The hpack context
+ * @param src       The source compressed header.
+ * @param slen      The length of the source
+ * @param buf       The output buffer for decoded strings
+ * @param refs      The array of field references (output)
+ * @param maxrefs   The number of field references in the array
+ * @return The number of fields, or a negative value to indicate an error
+ */
+XAPI int hpack_decodeRefs(h2_context_t * h2ctx, const char * src, int slen, h2_buffer_t * buf,
+        h2_fieldref_t * refs, int maxrefs);
+
+/*
+ * Decode an hpack header into header fields in an arena.
+ *
+ * This is the same as hpack_decodeRefs, but every name and value which is not in the
+ * static table is copied or decoded into the arena, so the fields are valid until the
+ * arena is freed.  An arena can be kept for a stream and used for all of its header
+ * blocks, and then freed at the end of the stream.  There is no heap allocation for
+ * each field and no limit on the length of a name or value.
+ *
+ * @param h2ctx     The hpack context
+ * @param src       The source compressed header.
+ * @param slen      The length of the source
+ * @param arena     The arena for the names and values
+ * @param refs      The array of fields (output)
+ * @param maxrefs   The number of fields in the array
+ * @return The number of fields, or a negative value to indicate an error
+ */
+XAPI int hpack_decodeArena(h2_context_t * h2ctx, const char * src, int slen, h2_arena_t * arena,
+        h2_fieldref_t * refs, int maxrefs);
+
+/*
+ * Get the value of a field reference.
+ *
+ * With the H2DECODE_LAZY option, hpack_decodeRefs does not decode the value of a huffman
+ * encoded literal which is not added to the dynamic table.  The field has the
+ * H2FIELD_VALSRC and H2FIELD_VALHUFF flags, and the value and length are those of the
+ * huffman bytes in the source block.  This decodes such a value into the arena and
+ * changes the field to reference it, so the cost of decoding is only paid for the values
+ * which are used.  Any other field is not changed.  The source block must not have
+ * changed since it was decoded.  A context with the H2DECODE_VALIDATE option decodes
+ * every value when the block is decoded, as the values must be checked before the
+ * block is accepted.
+ *
+ * The decode limits count a value left in the source at the shortest length it can
+ * decode to.  When the value is decoded, H2ERR_FIELDSIZE is returned if the field is
+ * larger than the field size limit, or the value is larger than the room the list size
+ * limit had left when the field was decoded.  The room is not shared, so several values
+ * decoded later can together still exceed the list size limit.
+ *
+ * @param ref    The field reference
+ * @param arena  The arena for the decoded value
+ * @return The length of the value, or a negative value to indicate an error
+ */
+XAPI int hpack_refValue(h2_fieldref_t * ref, h2_arena_t * arena);
+
+/*
+ * A part of an output for writev.  This has the same layout as struct iovec.
+ */
+typedef struct h2_iovec_t {
+    const char * base;           /**< The start of the part                         */
+    size_t       len;            /**< The length of the part                        */
+} h2_iovec_t;
+
+/*
+ * Decode an hpack header into an HTTP/1.1 message head.
+ *
+ * A request line is built from :method and :path, or from :method and :authority for
+ * CONNECT, and a status line is built from :status.  A block without pseudo-header
+ * fields, such as trailers, is written as just the fields.  :authority is written as a
+ * host field unless the block has one, the cookie crumbs are joined into one cookie
+ * field, other pseudo-header fields are dropped, and each line ends with CRLF.  The
+ * head ends with an empty line and is null terminated in the buffer.
+ *
+ * Every name and value is checked as with H2DECODE_VALIDATE whatever the options of the
+ * context, so a field can not add lines to the head.  The method must be a token, the
+ * path and authority must be visible ASCII with no space, and the status must be three
+ * digits, otherwise H2ERR_PSEUDO is returned.
+ *
+ * The fields are decoded as by hpack_decodeRefs and written directly into the head, so
+ * there is no intermediate text.  There is no limit on the number of fields.
+ *
+ * @param h2ctx     The hpack context
+ * @param src       The source compressed header.
+ * @param slen      The length of the source
+ * @param buf       The output buffer
+ * @return The length of the head, or a negative value to indicate an error
+ */
+XAPI int hpack_decodeHttp1(h2_context_t * h2ctx, const char * src, int slen, h2_buffer_t * buf);
+
+/*
+ * Decode an hpack header into the parts of an HTTP/1.1 message head.
+ *
+ * This is the same as hpack_decodeHttp1, but the head is returned as parts for writev
+ * which point to the source block, the dynamic table, the work buffer and constant text.
+ * Only huffman encoded strings are decoded into the work buffer.  The parts are valid
+ * until the next header block is decoded with the context, and while the source block
+ * and the work buffer are not changed.  A head needs at most 4 parts for each field
+ * plus 16.
+ *
+ * @param h2ctx     The hpack context
+ * @param src       The source compressed header.
+ * @param slen      The length of the source
+ * @param work      The buffer for decoded strings
+ * @param iov       The array of parts (output)
+ * @param maxiov    The number of parts in the array
+ * @return The number of parts, or a negative value to indicate an error
+ */
+XAPI int hpack_decodeHttp1Iov(h2_context_t * h2ctx, const char * src, int slen, h2_buffer_t * work,
+        h2_iovec_t * iov, int maxiov);
+
+/*
+ * Set the names of the fields returned by hpack_decodeTrack.
+ *
+ * The names are converted to lower case and kept in the context.  A count of 0 stops
+ * tracking, and hpack_decodeTrack then only updates the dynamic table.
+ *
+ * @param h2ctx  The hpack decoder context
+ * @param names  The names to track
+ * @param count  The number of names, at most 8
+ * @return 0=good, -1 if the context is not a decoder, there are too many names or a name
+ *         is empty, longer than 63 characters or not a valid field name
+ */
+XAPI int hpack_setTrackNames(h2_context_t * h2ctx, const char * const * names, int count);
+
+/*
+ * Decode an hpack header only to keep the dynamic table up to date.
+ *
+ * This is for a proxy which forwards header blocks unchanged.  The dynamic table size
+ * updates and the literals with incremental indexing are processed as by hpack_decode,
+ * but no output is formatted, and the other literals are skipped without being decoded
+ * unless they have a tracked name.  Indexed fields are checked against the table.
+ *
+ * The fields with a name set by hpack_setTrackNames are returned.  The name of such a
+ * field is the tracked name in the context, and the value is in the source block, the
+ * static table or the output buffer.  A value in the source is not null terminated.
+ * Decode limits are applied with the shortest length a string which is not decoded can
+ * decode to, and the H2DECODE_VALIDATE option only checks the strings which are decoded.
+ * When more tracked fields are found than the array holds, the rest of the block is
+ * still applied to the dynamic table and then H2ERR_FIELDS is returned.
+ *
+ * @param h2ctx     The hpack context
+ * @param src       The source compressed header.
+ * @param slen      The length of the source
+ * @param buf       The output buffer for the values of tracked fields
+ * @param refs      The tracked fields (output)
+ * @param maxrefs   The number of fields in the array
+ * @return The number of tracked fields, or a negative value to indicate an error
+ */
+XAPI int hpack_decodeTrack(h2_context_t * h2ctx, const char * src, int slen, h2_buffer_t * buf,
+        h2_fieldref_t * refs, int maxrefs);
+
+/*
+ * A set of routes matched by hpack_decodeRoute
+ */
+typedef struct h2_routes_t h2_routes_t;
+
+#define H2ROUTE_NONE      -1     /**< No route matches the block                    */
+
+/*
+ * Create an empty set of routes
+ * @return The routes or NULL if there is not enough memory
+ */
+XAPI h2_routes_t * hpack_newRoutes(void);
+
+/*
+ * Add a route.
+ *
+ * A path which ends with '*' matches any path which starts with the rest of it, and
+ * other paths match only themselves.  The longest matching path is used, and a route
+ * for the authority is used before a route for any authority.  The query of a request
+ * path from '?' is not matched.  The authority is converted to lower case.  Adding a
+ * route which is already in the set changes its route ID.
+ *
+ * @param routes     The routes
+ * @param authority  The :authority of the route, or NULL for any authority
+ * @param path       The path which starts with '/'
+ * @param route      The route ID which is not negative
+ * @return 0=good, -1 if the route is not valid, or H2ERR_ALLOC
+ */
+XAPI int hpack_addRoute(h2_routes_t * routes, const char * authority, const char * path, int route);
+
+/*
+ * Free a set of routes
+ */
+XAPI void hpack_freeRoutes(h2_routes_t * routes);
+
+/*
+ * Decode an hpack header into references to the header fields and match its route.
+ *
+ * This is hpack_decodeRefs which matches the :authority and :path fields against the
+ * routes while they are decoded, so there is no separate pass over the path.  A huffman
+ * encoded path is matched a part at a time as it is decoded.  As soon as the path can
+ * not match any route the block is rejected, the rest of the block only updates the
+ * dynamic table as by hpack_decodeTrack, and only the fields before the :path field are
+ * returned.  A rejected block leaves the context usable.  The routes are not changed by
+ * decoding, so one set can be used by many decoders at once.
+ *
+ * @param h2ctx     The hpack context
+ * @param src       The source compressed header.
+ * @param slen      The length of the source
+ * @param buf       The output buffer
+ * @param routes    The routes
+ * @param route     The route ID, or H2ROUTE_NONE if the block has no route (output)
+ * @param refs      The array of fields (output)
+ * @param maxrefs   The number of fields in the array
+ * @return The number of fields, or a negative value to indicate an error
+ */
+XAPI int hpack_decodeRoute(h2_context_t * h2ctx, const char * src, int slen, h2_buffer_t * buf,
+        const h2_routes_t * routes, int * route, h2_fieldref_t * refs, int maxrefs);
+
+/*
+ * A decoder for header blocks which arrive in parts
+ */
+typedef struct h2_partial_t h2_partial_t;
+
+/*
+ * Create a partial decoder for a decode context.
+ * @param h2ctx  The hpack decode context
+ * @return The partial decoder or NULL if it cannot be created
+ */
+XAPI h2_partial_t * hpack_newPartial(h2_context_t * h2ctx);
+
+/*
+ * Decode part of an hpack header into header fields in an arena.
+ *
+ * The header block can be split anywhere, including within an integer or a huffman
+ * encoded string, so each frame can be decoded as it is received without joining the
+ * HEADERS and CONTINUATION frames.  The fields which are completed by this part are
+ * returned, and a field which is not complete is kept in the decoder until the next part.
+ * The same arena must be used for all parts of a header block.
+ *
+ * As a string is kept until all of its bytes arrive, its length is checked when it is
+ * known.  A string longer than the field size limit, or 16MB when there is no limit, or
+ * longer than the table size for a field to be added to the dynamic table, is rejected
+ * with H2ERR_FIELDSIZE.
+ *
+ * An error leaves the decoder and the context in an unknown state, so the connection
+ * must be closed.
+ *
+ * @param pd        The partial decoder
+ * @param src       The part of the compressed header
+ * @param slen      The length of the part
+ * @param last      Set if this part ends the header block
+ * @param arena     The arena for the names and values
+ * @param refs      The array of fields (output)
+ * @param maxrefs   The number of fields in the array
+ * @return The number of fields completed by this part, or a negative value to indicate an error
+ */
+XAPI int hpack_decodePartial(h2_partial_t * pd, const char * src, int slen, int last, h2_arena_t * arena,
+        h2_fieldref_t * refs, int maxrefs);
+
+/*
+ * Free a partial decoder.  This does not free the context.
+ * @param pd  The partial decoder
+ */
+XAPI void hpack_freePartial(h2_partial_t * pd);
+
+/*
+ * Encode decoded header fields.
+ *
+ * This is used by a proxy to send the fields decoded by hpack_decodeFields on another
+ * connection.  When the decoder has the H2DECODE_RAWHUFF option and the encoder uses
+ * huffman encoding, a value which is sent as a literal is copied from the huffman bytes
+ * of the field instead of being encoded again.
+ *
+ * @param h2ctx   The hpack encoder context
+ * @param base    The output buffer of the decoder which the field offsets are in
+ * @param fields  The fields
+ * @param count   The number of fields
+ * @param buf     The output buffer
+ * @return A return code, 0=good
+ */
+XAPI int hpack_encodeFields(h2_context_t * h2ctx, const char * base, const h2_field_t * fields, int count,
+        h2_buffer_t * buf);
+
+/*
+ * Set the extra well known header names.
+ *
+ * Each name is given the ID H2ID_EXTRA plus its position in the list.  Names in the
+ * static table already have an ID and their position is not used.  The list is process wide and
+ * replaces any previous list.  It must be set while no context exists, as the
+ * dynamic table entries match names by their IDs.
+ *
+ * @param names  The lower case header names
+ * @param count  The number of names, at most H2ID_MAXEXTRA
+ * @return The number of names set, or -1 if there are too many names or a context exists
+ */
+XAPI int hpack_setHeaderIds(const char * const * names, int count);
+
+/*
+ * Get the well known header ID of a name
+ * @param name  The header name
+ * @param len   The length of the name
+ * @return The header ID or H2ID_UNKNOWN
+ */
+XAPI int hpack_getHeaderId(const char * name, int len);
+
+/*
+ * Add a name to the process wide interned name pool.
+ *
+ * Dynamic table entries with an interned name point to the single interned copy, and
+ * the name is matched by its header ID.  Names are also interned automatically when
+ * an encoder has seen them often enough.  Names from a peer are never counted.  The pool is
+ * read without a lock, holds at most H2ID_MAXINTERN names, and names are never removed.
+ *
+ * @param name  The lower case header name
+ * @param len   The length of the name
+ * @return The header ID of the name, or H2ID_UNKNOWN if the pool is full
+ */
+XAPI int hpack_internName(const char * name, int len);
+
+/*
+ * Set the number of times a name must be seen before it is automatically interned
+ * @param count  The number of times, or 0 to only intern names using hpack_internName
+ */
+XAPI void hpack_setInternThreshold(int count);
+
+/*
+ * Get the name for a well known header ID
+ * @param id  The header ID
+ * @return The header name or NULL if the ID is not known
+ */
+XAPI const char * hpack_getHeaderName(int id);
+
+/*
+ * Internal functions which are exposed for unit test
+ */
+int hpack_canonicalize(char * buf, int len);
+int hpack_changeDynamic(h2_context_t * h2ctx, int size);
+int hpack_pushDynamic(h2_context_t * h2ctx, const char * hdr, const char * value);
+int hpack_lookupDynamic(h2_context_t * h2ctx, const char * hdr, const char * value);
+int hpack_lookupStatic(const char * hdr, const char * value);
+int hpack_lookupStaticLen(const char * hdr, int hdrlen, const char * value, int vallen);
+void hpack_setEncodeVariant(h2_context_t * h2ctx, int specialized);
+int hpack_setMemo(h2_context_t * h2ctx, int enable);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
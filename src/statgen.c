@@ -0,0 +1,175 @@
+/*
+ * Create the perfect hash tables for the hpack static table lookup
+ *
+ * The output is h2static.h which is included by hpack.c.
+ * The name hash uses the length and the first, middle, and last characters of the
+ * name.  The name and value hash uses the static index of the name and the length
+ * and the first and last characters of the value.  A multiplier is searched for which
+ * maps each key to a different slot.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#define NAMEBITS 8
+#define PAIRBITS 5
+
+/*
+ * The static table from RFC 7541 appendix A
+ */
+static const char * names[62] = {
+    NULL,
+    ":authority", ":method", ":method", ":path", ":path", ":scheme", ":scheme",
+    ":status", ":status", ":status", ":status", ":status", ":status", ":status",
+    "accept-charset", "accept-encoding", "accept-language", "accept-ranges", "accept",
+    "access-control-allow-origin", "age", "allow", "authorization", "cache-control",
+    "content-disposition", "content-encoding", "content-language", "content-length",
+    "content-location", "content-range", "content-type", "cookie", "date", "etag",
+    "expect", "expires", "from", "host", "if-match", "if-modified-since", "if-none-match",
+    "if-range", "if-unmodified-since", "last-modified", "link", "location", "max-forwards",
+    "proxy-authenticate", "proxy-authorization", "range", "referer", "refresh",
+    "retry-after", "server", "set-cookie", "strict-transport-security",
+    "transfer-encoding", "user-agent", "vary", "via", "www-authenticate",
+};
+
+static const char * values[17] = {
+    "", "", "GET", "POST", "/", "/index.html", "http", "https", "200", "204", "206",
+    "304", "400", "404", "500", "", "gzip, deflate",
+};
+
+/* The hash functions as they are written to the output */
+#define NAMEHASH_TEXT "((((uint32_t)(len) << 24) ^ ((uint32_t)(uint8_t)(s)[0] << 16) ^ " \
+                      "((uint32_t)(uint8_t)(s)[(len)>>1] << 8) ^ (uint8_t)(s)[(len)-1]) * H2S_NAMESEED >> (32-H2S_NAMEBITS))"
+#define PAIRHASH_TEXT "((((uint32_t)(inx) << 24) ^ ((uint32_t)(len) << 16) ^ " \
+                      "((uint32_t)(uint8_t)(v)[0] << 8) ^ (uint8_t)(v)[(len)-1]) * H2S_PAIRSEED >> (32-H2S_PAIRBITS))"
+
+static uint32_t namekey(const char * s, int len) {
+    return ((uint32_t)len << 24) ^ ((uint32_t)(uint8_t)s[0] << 16) ^ ((uint32_t)(uint8_t)s[len>>1] << 8) ^ (uint8_t)s[len-1];
+}
+
+static uint32_t pairkey(int inx, const char * v, int len) {
+    return ((uint32_t)inx << 24) ^ ((uint32_t)len << 16) ^ ((uint32_t)(uint8_t)v[0] << 8) ^ (uint8_t)v[len-1];
+}
+
+int main (int argc, char * * argv) {
+    uint32_t keys [64];
+    int      kinx [64];
+    uint8_t  nametab [1<<NAMEBITS];
+    uint8_t  pairtab [1<<PAIRBITS];
+    uint8_t  first [62];
+    uint32_t nameseed;
+    uint32_t pairseed;
+    int      count;
+    int      i;
+    int      j;
+
+    /* The name keys, using the first index of each name */
+    count = 0;
+    for (i=1; i<62; i++) {
+        first[i] = i;
+        if (i > 1 && !strcmp(names[i-1], names[i])) {
+            first[i] = first[i-1];
+            continue;
+        }
+        keys[count] = namekey(names[i], (int)strlen(names[i]));
+        kinx[count++] = i;
+    }
+    for (i=0; i<count; i++) {
+        for (j=0; j<i; j++) {
+            if (keys[i] == keys[j]) {
+                fprintf(stderr, "name key not unique: %s %s\n", names[kinx[i]], names[kinx[j]]);
+                return 1;
+            }
+        }
+    }
+    for (nameseed = 0x9e3779b1; ; nameseed += 2) {
+        memset(nametab, 0, sizeof nametab);
+        for (i=0; i<count; i++) {
+            uint32_t slot = keys[i] * nameseed >> (32-NAMEBITS);
+            if (nametab[slot])
+                break;
+            nametab[slot] = kinx[i];
+        }
+        if (i == count)
+            break;
+    }
+
+    /* The name and value keys */
+    count = 0;
+    for (i=1; i<17; i++) {
+        if (*values[i]) {
+            keys[count] = pairkey(first[i], values[i], (int)strlen(values[i]));
+            kinx[count++] = i;
+        }
+    }
+    for (pairseed = 0x9e3779b1; ; pairseed += 2) {
+        memset(pairtab, 0, sizeof pairtab);
+        for (i=0; i<count; i++) {
+            uint32_t slot = keys[i] * pairseed >> (32-PAIRBITS);
+            if (pairtab[slot])
+                break;
+            pairtab[slot] = kinx[i];
+        }
+        if (i == count)
+            break;
+    }
+
+    printf("/*\n * Perfect hash tables for the hpack static table.\n");
+    printf(" * This file is created by statgen.c and should not be edited.\n */\n\n");
+    printf("#define H2S_NAMEBITS %d\n", NAMEBITS);
+    printf("#define H2S_NAMESEED 0x%08xU\n", nameseed);
+    printf("#define H2S_PAIRBITS %d\n", PAIRBITS);
+    printf("#define H2S_PAIRSEED 0x%08xU\n\n", pairseed);
+    printf("/*\n * Hash of a name with a length of at least 1\n */\n");
+    printf("#define H2S_NAMEHASH(s, len) \\\n    %s\n\n", NAMEHASH_TEXT);
+    printf("/*\n * Hash of the first static index of a name and a value with a length of at least 1\n */\n");
+    printf("#define H2S_PAIRHASH(inx, v, len) \\\n    %s\n\n", PAIRHASH_TEXT);
+
+    printf("/*\n * Map from name hash to the first static index with the name\n */\n");
+    printf("uint8_t h2s_names [%d] = {", 1<<NAMEBITS);
+    for (i=0; i<(1<<NAMEBITS); i++) {
+        if (i%16 == 0)
+            printf("\n    /* %03x */  ", i);
+        printf("%2d, ", nametab[i]);
+    }
+    printf("\n};\n\n");
+
+    printf("/*\n * Map from name and value hash to the static index\n */\n");
+    printf("uint8_t h2s_pairs [%d] = {", 1<<PAIRBITS);
+    for (i=0; i<(1<<PAIRBITS); i++) {
+        if (i%16 == 0)
+            printf("\n    /* %03x */  ", i);
+        printf("%2d, ", pairtab[i]);
+    }
+    printf("\n};\n\n");
+
+    printf("/*\n * The first static index with the same name as each index\n */\n");
+    printf("uint8_t h2s_first [62] = {");
+    first[0] = 0;
+    for (i=0; i<62; i++) {
+        if (i%16 == 0)
+            printf("\n    /* %03d */  ", i);
+        printf("%2d, ", first[i]);
+    }
+    printf("\n};\n\n");
+
+    printf("/*\n * The length of each static name\n */\n");
+    printf("uint8_t h2s_namelen [62] = {");
+    for (i=0; i<62; i++) {
+        if (i%16 == 0)
+            printf("\n    /* %03d */  ", i);
+        printf("%2d, ", i ? (int)strlen(names[i]) : 0);
+    }
+    printf("\n};\n\n");
+
+    printf("/*\n * The length of each static value\n */\n");
+    printf("uint8_t h2s_vallen [17] = {");
+    for (i=0; i<17; i++) {
+        if (i%16 == 0)
+            printf("\n    /* %03d */  ", i);
+        printf("%2d, ", (int)strlen(values[i]));
+    }
+    printf("\n};\n");
+    return 0;
+}